@@ -1,4 +1,95 @@
 var upTimeInterval, startTime, ws;
+//S21 port shown and controlled by this page, from the url (?port=N)
+var acPort = Number(new URLSearchParams(window.location.search).get("port")) || 0;
+//last full values of the port and sequence number of the last delta applied on them
+var acState = {}, acSeq = -1;
+//a resync was asked and its full values aren't here yet: later gaps don't ask again
+var acResyncing = false;
+//websocket format, from the url (?format=msgpack): MessagePack frames are smaller and faster to parse than JSON
+var wsMsgPack = new URLSearchParams(window.location.search).get("format") == "msgpack";
+
+//MessagePack, only the types the device sends
+function msgpackDecode(buf){
+	var view = new DataView(buf), pos = 0;
+	function num(get, size){ var v = view[get](pos); pos += size; return v; }
+	function str(len){ var s = new TextDecoder().decode(new Uint8Array(buf, pos, len)); pos += len; return s; }
+	function arr(len){ var a = []; while (len--) a.push(read()); return a; }
+	function map(len){ var m = {}; while (len--){ var k = read(); m[k] = read(); } return m; }
+	function read(){
+		var b = view.getUint8(pos++);
+		if (b < 0x80) return b;
+		if (b < 0x90) return map(b & 0x0f);
+		if (b < 0xa0) return arr(b & 0x0f);
+		if (b < 0xc0) return str(b & 0x1f);
+		if (b >= 0xe0) return b - 0x100;
+		switch (b){
+			case 0xc0: return null;
+			case 0xc2: return false;
+			case 0xc3: return true;
+			case 0xca: return num("getFloat32", 4);
+			case 0xcb: return num("getFloat64", 8);
+			case 0xcc: return num("getUint8", 1);
+			case 0xcd: return num("getUint16", 2);
+			case 0xce: return num("getUint32", 4);
+			case 0xcf: return Number(num("getBigUint64", 8));
+			case 0xd0: return num("getInt8", 1);
+			case 0xd1: return num("getInt16", 2);
+			case 0xd2: return num("getInt32", 4);
+			case 0xd3: return Number(num("getBigInt64", 8));
+			case 0xd9: return str(num("getUint8", 1));
+			case 0xda: return str(num("getUint16", 2));
+			case 0xdb: return str(num("getUint32", 4));
+			case 0xdc: return arr(num("getUint16", 2));
+			case 0xdd: return arr(num("getUint32", 4));
+			case 0xde: return map(num("getUint16", 2));
+			case 0xdf: return map(num("getUint32", 4));
+		}
+		throw new Error("Unsupported MessagePack type " + b);
+	}
+	return read();
+}
+//commands: objects, arrays, strings, numbers and booleans
+function msgpackEncode(value){
+	var bytes = [];
+	function uint(v, size){ for (var i = size - 1; i >= 0; i--) bytes.push((v / Math.pow(256, i)) & 0xff); }
+	function head(len, fix, max, code){
+		if (len < max){ bytes.push(fix | len); } else { bytes.push(code); uint(len, 2); }
+	}
+	function write(v){
+		if (v === null || v === undefined){
+			bytes.push(0xc0);
+		} else if (typeof v == "boolean"){
+			bytes.push(v ? 0xc3 : 0xc2);
+		} else if (typeof v == "number" && Number.isInteger(v) && v >= -32 && v < 128){
+			bytes.push(v & 0xff);
+		} else if (typeof v == "number" && Number.isInteger(v) && Math.abs(v) < 0x80000000){
+			bytes.push(0xd2);
+			uint(v >>> 0, 4);
+		} else if (typeof v == "number"){
+			var f = new DataView(new ArrayBuffer(8));
+			f.setFloat64(0, v);
+			bytes.push(0xcb);
+			for (var i = 0; i < 8; i++) bytes.push(f.getUint8(i));
+		} else if (typeof v == "string"){
+			var s = new TextEncoder().encode(v);
+			if (s.length < 32){ bytes.push(0xa0 | s.length); } else if (s.length < 256){ bytes.push(0xd9, s.length); } else { bytes.push(0xda); uint(s.length, 2); }
+			s.forEach(function(b){ bytes.push(b); });
+		} else if (Array.isArray(v)){
+			head(v.length, 0x90, 16, 0xdc);
+			v.forEach(write);
+		} else {
+			var keys = Object.keys(v);
+			head(keys.length, 0x80, 16, 0xde);
+			keys.forEach(function(k){ write(k); write(v[k]); });
+		}
+	}
+	write(value);
+	return new Uint8Array(bytes).buffer;
+}
+//sends a command in the websocket format
+function wsSend(msg){
+	ws.send(wsMsgPack ? msgpackEncode(msg) : JSON.stringify(msg));
+}
 function upTimeMsg(uptime){
 	// calculate (and subtract) whole days
 	var days = Math.floor(uptime / 86400);
@@ -15,10 +106,61 @@ function upTimeMsg(uptime){
 	return String(days).padStart(2, '0') + "d:" + String(hours).padStart(2, '0') + "h:" + String(minutes).padStart(2, '0') + "m";
 }
 
+//last 24 hours from the device history: temperatures as lines, compressor frequency as bars below them
+function drawHistory(){
+	$.get("/history?port=" + acPort + "&fields=temp_inside,temp_outside,compressor_freq", function(csv){
+		var rows = csv.trim().split("\n").slice(1).map(function(line){ return line.split(",").map(Number); });
+		var canvas = document.getElementById("historyChart");
+		canvas.width = canvas.clientWidth;
+		canvas.height = canvas.clientHeight;
+		var ctx = canvas.getContext("2d"), w = canvas.width, h = canvas.height, pad = 30;
+		ctx.clearRect(0, 0, w, h);
+		if (rows.length < 2){
+			ctx.fillText("No history yet", w / 2 - 30, h / 2);
+			return;
+		}
+		var end = rows[rows.length - 1][0], start = end - 86400;
+		var temps = rows.map(function(r){ return r[1]; }).concat(rows.map(function(r){ return r[2]; }));
+		var tMin = Math.floor(Math.min.apply(null, temps) / 50) * 50, tMax = Math.ceil(Math.max.apply(null, temps) / 50) * 50 || tMin + 50;
+		var fMax = Math.max(100, Math.max.apply(null, rows.map(function(r){ return r[3]; })));
+		function x(t){ return pad + (t - start) / 86400 * (w - 2 * pad); }
+		function y(temp){ return h - pad - (temp - tMin) / (tMax - tMin) * (h - 2 * pad); }
+		//compressor
+		ctx.fillStyle = "rgba(255, 152, 0, 0.3)";
+		rows.forEach(function(r, i){
+			if (i > 0 && r[3] > 0){
+				ctx.fillRect(x(rows[i - 1][0]), h - pad - r[3] / fMax * (h - 2 * pad), x(r[0]) - x(rows[i - 1][0]), r[3] / fMax * (h - 2 * pad));
+			}
+		});
+		//temperatures, in tenths of C
+		[[1, "#dc3545", "inside"], [2, "#0d6efd", "outside"]].forEach(function(line, n){
+			ctx.strokeStyle = line[1];
+			ctx.beginPath();
+			rows.forEach(function(r, i){
+				if (i == 0) ctx.moveTo(x(r[0]), y(r[line[0]])); else ctx.lineTo(x(r[0]), y(r[line[0]]));
+			});
+			ctx.stroke();
+			ctx.fillStyle = line[1];
+			ctx.fillText(line[2], pad + n * 60, 12);
+		});
+		ctx.fillStyle = "rgba(255, 152, 0, 0.8)";
+		ctx.fillText("compressor", pad + 120, 12);
+		ctx.fillStyle = "#000";
+		ctx.fillText((tMax / 10) + "°C", 0, pad);
+		ctx.fillText((tMin / 10) + "°C", 0, h - pad);
+		ctx.fillText("-24h", pad, h - 10);
+		ctx.fillText(new Date(end * 1000).toLocaleTimeString("it-IT"), w - pad - 50, h - 10);
+	});
+}
+
 $( document ).ready(function() {
 	//enabling tooltips
 	$('[data-toggle="tooltip"]').tooltip()
 	
+	//history chart, again every 10 minutes
+	drawHistory();
+	setInterval(drawHistory, 600000);
+
 	//recurring update of uptime
 	upTimeInterval = setInterval(function(){ 
 		console.log("Calculating uptime");
@@ -39,7 +181,7 @@ $( document ).ready(function() {
 			json_arr["command"] = "config";
 			json_arr['target'] = "period";
 			json_arr["value"] = data.from;
-			ws.send(JSON.stringify(json_arr));
+			wsSend(json_arr);
 		}
     });
 	
@@ -52,7 +194,7 @@ $( document ).ready(function() {
 		json_arr["command"] = "config";
 		json_arr["target"] = "httpEnable";
 		json_arr["value"] = $(this).prop('checked');
-		ws.send(JSON.stringify(json_arr));
+		wsSend(json_arr);
 	});
 	$('#httpControlToggle').change(function() {
 		console.log("Sending httpControl config (" + $(this).prop('checked') + ")");
@@ -60,7 +202,7 @@ $( document ).ready(function() {
 		json_arr["command"] = "config";
 		json_arr["target"] = "httpControlEnable";
 		json_arr["value"] = $(this).prop('checked');
-		ws.send(JSON.stringify(json_arr));
+		wsSend(json_arr);
 	});
 	$('#mqttControlToggle').change(function() {
 		console.log("Sending mqttControl config (" + $(this).prop('checked') + ")");
@@ -68,7 +210,7 @@ $( document ).ready(function() {
 		json_arr["command"] = "config";
 		json_arr["target"] = "mqttControlEnable";
 		json_arr["value"] = $(this).prop('checked');
-		ws.send(JSON.stringify(json_arr));
+		wsSend(json_arr);
 	});
 
 	//data forms
@@ -80,7 +222,7 @@ $( document ).ready(function() {
 		json_arr["target"] = "httpAccessData";
 		json_arr["username"] = $("#httpUsername").val();
 		json_arr["password"] = $("#httpPassword").val();
-		ws.send(JSON.stringify(json_arr));
+		wsSend(json_arr);
 	});
 	$("#mqttSecurityForm").on('submit', function(e){
 		e.preventDefault();
@@ -90,7 +232,7 @@ $( document ).ready(function() {
 		json_arr["target"] = "mqttAccessData";
 		json_arr["username"] = $("#mqttUsername").val();
 		json_arr["password"] = $("#mqttPassword").val();
-		ws.send(JSON.stringify(json_arr));
+		wsSend(json_arr);
 	});
 	$("#mqttDataForm").on('submit', function(e){
 		e.preventDefault();
@@ -102,7 +244,7 @@ $( document ).ready(function() {
 		json_arr["subTopic"] = $("#mqttSubTopic").val();
 		json_arr["pubTopic"] = $("#mqttPubTopic").val();
 		json_arr["testamentTopic"] = $("#mqttTestamentTopic").val();
-		ws.send(JSON.stringify(json_arr));
+		wsSend(json_arr);
 	});
 	$("#hostnameForm").on('submit', function(e){
 		e.preventDefault();
@@ -112,7 +254,7 @@ $( document ).ready(function() {
 			json_arr["command"] = "config";
 			json_arr["target"] = "hostname";
 			json_arr["value"] = $("#hostname").val();
-			ws.send(JSON.stringify(json_arr));
+			wsSend(json_arr);
 		}
 	});	
 	// Bottons commands control
@@ -122,7 +264,7 @@ $( document ).ready(function() {
 			console.log("Sending reset command");
 			var json_arr = {};
 			json_arr["command"] = "rstDevice";
-			ws.send(JSON.stringify(json_arr));
+			wsSend(json_arr);
 			//refreshing page in 5 seconds
 			setTimeout(function(){ location.reload(); }, 5000);
 		} else {
@@ -135,7 +277,7 @@ $( document ).ready(function() {
 			console.log("Sending reset wifi command");
 			var json_arr = {};
 			json_arr["command"] = "rstWifi";
-			ws.send(JSON.stringify(json_arr));
+			wsSend(json_arr);
 		} else {
 			console.log("Reset wifi command canceled");
 		}
@@ -151,9 +293,10 @@ $( document ).ready(function() {
 		//and sending
 		var json_arr = {};
 		json_arr["command"] = "acTemp";
+		json_arr["port"] = acPort;
 		json_arr["temp"] = $('.target-temp').text().slice(0, -2).trim();
 
-		ws.send(JSON.stringify(json_arr));	
+		wsSend(json_arr);	
 
 		console.log("Sending temperature command for AC");
 		console.log(JSON.stringify(json_arr));
@@ -170,9 +313,10 @@ $( document ).ready(function() {
 		}
 		var json_arr = {};
 		json_arr["command"] = "acPower";
+		json_arr["port"] = acPort;
 		json_arr["power"] = $('#pwr-button').prop("checked");
 
-		ws.send(JSON.stringify(json_arr));	
+		wsSend(json_arr);	
 
 		console.log("Sending power command for AC");
 		console.log(JSON.stringify(json_arr));
@@ -182,9 +326,10 @@ $( document ).ready(function() {
 	$("input[type='radio'][name='mode']").on('change', function(e){
 		var json_arr = {};
 		json_arr["command"] = "acMode";
+		json_arr["port"] = acPort;
 		json_arr["mode"] = $("input[type='radio'][name='mode']:checked").val();
 
-		ws.send(JSON.stringify(json_arr));	
+		wsSend(json_arr);	
 
 		console.log("Sending mode command for AC");
 		console.log(JSON.stringify(json_arr));
@@ -193,9 +338,10 @@ $( document ).ready(function() {
 	$("input[type='radio'][name='fan']").on('change', function(e){
 		var json_arr = {};
 		json_arr["command"] = "acFan";
+		json_arr["port"] = acPort;
 		json_arr["fan"] = $("input[type='radio'][name='fan']:checked").val();
 
-		ws.send(JSON.stringify(json_arr));	
+		wsSend(json_arr);	
 
 		console.log("Sending fan command for AC");
 		console.log(JSON.stringify(json_arr));
@@ -205,8 +351,9 @@ $( document ).ready(function() {
 	$("#oscv-button").on('click', function(e){
 		var json_arr = {};
 		json_arr["command"] = "acSwingV";
+		json_arr["port"] = acPort;
 		json_arr["swingV"] = $('#oscv-button').prop("checked");
-		ws.send(JSON.stringify(json_arr));	
+		wsSend(json_arr);	
 
 		console.log("Sending SwingV command for AC");
 		console.log(JSON.stringify(json_arr));
@@ -215,8 +362,9 @@ $( document ).ready(function() {
 	$("#osch-button").on('click', function(e){
 		var json_arr = {};
 		json_arr["command"] = "acSwingH";
+		json_arr["port"] = acPort;
 		json_arr["swingH"] = $('#osch-button').prop("checked");
-		ws.send(JSON.stringify(json_arr));	
+		wsSend(json_arr);	
 
 		console.log("Sending SwingH command for AC");
 		console.log(JSON.stringify(json_arr));
@@ -224,16 +372,44 @@ $( document ).ready(function() {
 
 	// Let us open a web socket, not secure
 	ws = new WebSocket("ws://" + window.location.host + "/ws");
+	ws.binaryType = "arraybuffer";
 	ws.onopen = function() {
 		console.log("WebSocket connected.")
+		//the device switches to MessagePack on the first MessagePack frame, and sends everything again
+		if (wsMsgPack){
+			wsSend({"command": "hello"});
+		}
 	};
 	
 	ws.onmessage = function (evt) { 
-		var received_msg = evt.data;
-		console.log("Received: " + received_msg);
 		try{
-			var data = $.parseJSON(received_msg);
-			if(data["type"] == "sensor"){
+			var data;
+			if (typeof evt.data == "string"){
+				//JSON, until the device gets the hello
+				console.log("Received: " + evt.data);
+				data = $.parseJSON(evt.data);
+			} else {
+				data = msgpackDecode(evt.data);
+				console.log("Received: " + JSON.stringify(data));
+			}
+			if((data["type"] == "sensor" || data["type"] == "delta") && (data["port"] || 0) == acPort){
+				//deltas carry only changed fields, in order. On a gap, asking for full values again
+				if ( data["type"] == "delta" ){
+					if ( data["seq"] != acSeq + 1 ){
+						if ( !acResyncing ){
+							console.log("Missed sensor delta, resyncing");
+							acResyncing = true;
+							wsSend({"command": "resync", "port": acPort});
+						}
+						return;
+					}
+					data = Object.assign({}, acState, data);
+				}
+				if ( data["type"] == "sensor" ){
+					acResyncing = false;
+				}
+				acState = data;
+				acSeq = data["seq"];
 
 				//temp
 				$('.target-temp').text( Number(data['setpoint']/10.0) + "°C");
@@ -349,6 +525,38 @@ $( document ).ready(function() {
 					$('#restartNeededAlert').hide();
 				}
 
+			} else if (data["type"] == "bus" && (data["port"] || 0) == acPort){
+				$('#busDuty').html(data['duty'] + "%");
+				$('#busGap').html(data['gap'] + "ms");
+				$('#busCmdAckTimeout').html(data['cmdAckTimeout'] + "ms");
+				$('#busTransport').html(data['transport']);
+				$('#busLineErrors').html(data['lineErrors']);
+				$('#busBadFrames').html(data['badFrames'] + "/" + data['frames']);
+				$('#busErrors').html(Object.keys(data['errors']).map(function(e){ return e + " " + data['errors'][e]; }).join(", "));
+				$('#busLoopRate').html(data['loopRate'] + "/s");
+				$('#busFrameRate').html(data['frameRate'] + "/s");
+				var rows = "";
+				data['regs'].forEach(function(reg){
+					//demoted registers are not polled for a while, they keep failing
+					rows += "<tr" + (reg[6] ? " class=\"table-warning\"" : "") + "><td>" + reg[0] + "</td><td>" + reg[1] + "ms</td><td>" + reg[2] + "ms</td><td>" + reg[3] + "</td><td>" + reg[4] + "</td><td>" + reg[5] + "</td></tr>";
+				});
+				$('#busTimeouts').html(rows);
+				//buckets labels from edges
+				var head = "<tr><th></th>";
+				data['edges'].forEach(function(edge){
+					head += "<th>&lt;" + edge + "</th>";
+				});
+				head += "<th>&ge;" + data['edges'][data['edges'].length - 1] + "</th></tr>";
+				$('#busHistHead').html(head);
+				rows = "";
+				[["ACK", "ack"], ["First byte", "firstByte"], ["Frame", "frame"]].forEach(function(hist){
+					rows += "<tr><td>" + hist[0] + "</td>";
+					data[hist[1]].forEach(function(count){
+						rows += "<td>" + count + "</td>";
+					});
+					rows += "</tr>";
+				});
+				$('#busHist').html(rows);
 			} else if (data["type"] == "rssi"){
 				$('#wifiRssi').html("(" + data['value'] + "dBm)");
 			} else if ( data["type"] == "startTime" ){
@@ -0,0 +1,120 @@
+#include "History.h"
+
+//zigzag varints: small deltas, of any sign, in few bytes
+static uint8_t putVarint(uint8_t *buf, int32_t value) {
+  uint32_t v = ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+  uint8_t len = 0;
+  while ( v >= 0x80 ){
+    buf[len++] = (v & 0x7F) | 0x80;
+    v >>= 7;
+  }
+  buf[len++] = v;
+  return len;
+}
+//0 if the varint runs over end
+static uint8_t getVarint(const uint8_t *buf, const uint8_t *end, int32_t &value) {
+  uint32_t v = 0;
+  uint8_t len = 0;
+  while ( buf + len < end && len < 5 ){
+    uint8_t b = buf[len];
+    v |= (uint32_t)(b & 0x7F) << (7 * len);
+    len++;
+    if ( !(b & 0x80) ){
+      value = (int32_t)(v >> 1) ^ -(int32_t)(v & 1);
+      return len;
+    }
+  }
+  return 0;
+}
+
+bool historyBlock::append(const historySample &s, const historySample *previous) {
+  //longest sample: time, mask and all values at 5 bytes each
+  uint8_t buf[1 + (HISTORY_VALUES + 1) * 5];
+  uint8_t len = 0;
+  if ( !previous || count == 0 ){
+    len += putVarint(buf + len, (int32_t)s.time);
+    for (uint8_t i = 0; i < HISTORY_VALUES; i++) {
+      len += putVarint(buf + len, s.values[i]);
+    }
+  } else {
+    len += putVarint(buf + len, (int32_t)(s.time - previous->time));
+    uint8_t &mask = buf[len++];
+    mask = 0;
+    for (uint8_t i = 0; i < HISTORY_VALUES; i++) {
+      if ( s.values[i] != previous->values[i] ){
+        mask |= 1 << i;
+        len += putVarint(buf + len, s.values[i] - previous->values[i]);
+      }
+    }
+  }
+  if ( count == UINT8_MAX || used + len > sizeof(data) ){
+    return false;
+  }
+  for (uint8_t i = 0; i < len; i++) {
+    data[used + i] = buf[i];
+  }
+  used += len;
+  count++;
+  magic = HISTORY_MAGIC;
+  return true;
+}
+
+void historyBlockReader::start(const historyBlock *b) {
+  block = b;
+  pos = 0;
+  index = 0;
+}
+
+bool historyBlockReader::next(historySample &s) {
+  if ( !block || block->magic != HISTORY_MAGIC || index >= block->count || block->used > sizeof(block->data) ){
+    return false;
+  }
+  const uint8_t *p = block->data + pos, *end = block->data + block->used;
+  int32_t v;
+  uint8_t len;
+  if ( index == 0 ){
+    if ( !(len = getVarint(p, end, v)) ) return false;
+    p += len;
+    last.time = (uint32_t)v;
+    for (uint8_t i = 0; i < HISTORY_VALUES; i++) {
+      if ( !(len = getVarint(p, end, v)) ) return false;
+      p += len;
+      last.values[i] = v;
+    }
+  } else {
+    if ( !(len = getVarint(p, end, v)) || p + len >= end ) return false;
+    p += len;
+    last.time += v;
+    uint8_t mask = *p++;
+    for (uint8_t i = 0; i < HISTORY_VALUES; i++) {
+      if ( mask & (1 << i) ){
+        if ( !(len = getVarint(p, end, v)) ) return false;
+        p += len;
+        last.values[i] += v;
+      }
+    }
+  }
+  pos = p - block->data;
+  index++;
+  s = last;
+  return true;
+}
+
+void historyRing::add(const historySample &s) {
+  historyBlock &b = blocks[sealed % HISTORY_RING_BLOCKS];
+  if ( !b.append(s, &last) ){
+    //full: sealed, the next one starts over the oldest
+    sealed++;
+    historyBlock &next = blocks[sealed % HISTORY_RING_BLOCKS];
+    next.clear();
+    next.append(s, nullptr);
+  }
+  last = s;
+}
+
+const historyBlock* historyRing::block(uint32_t n) const {
+  if ( n > sealed || n < oldest() ){
+    return nullptr;
+  }
+  return &blocks[n % HISTORY_RING_BLOCKS];
+}
@@ -0,0 +1,71 @@
+/*
+Telemetry history: timed samples of a few values, delta-encoded in fixed size blocks.
+A block starts with a full sample, the next ones are stored as changes from the previous one: time step, mask of the
+values that changed and their deltas, as zigzag varints. A steady sample takes 2 bytes, so a block holds about an hour
+at one sample a minute. Blocks are decoded on their own, so they can be stored, dropped and streamed one at a time.
+The last blocks are kept in RAM by historyRing, the application stores sealed ones wherever it likes.
+*/
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+//values in a sample
+#define HISTORY_VALUES 7
+//bytes in a block, header included
+#define HISTORY_BLOCK_SIZE 256
+//blocks kept in RAM, the one being filled included
+#define HISTORY_RING_BLOCKS 4
+//marks a block in use, and the encoding
+#define HISTORY_MAGIC 0xB1
+
+struct historySample {
+  uint32_t time = 0; //epoch, s
+  int32_t values[HISTORY_VALUES] = {};
+};
+
+struct historyBlock {
+  uint8_t magic = 0;
+  uint8_t count = 0; //samples
+  uint16_t used = 0; //bytes of data
+  uint8_t data[HISTORY_BLOCK_SIZE - 4];
+
+  //adds a sample, as a change from previous (nullptr for the first one). False if it doesn't fit: the block is full
+  bool append(const historySample &s, const historySample *previous);
+  void clear() { magic = 0; count = 0; used = 0; }
+};
+static_assert(sizeof(historyBlock) == HISTORY_BLOCK_SIZE, "blocks are stored as they are");
+
+//reads the samples of a block, in order
+class historyBlockReader {
+  public:
+    explicit historyBlockReader(const historyBlock *block = nullptr) { start(block); }
+    void start(const historyBlock *block);
+    //false at the end of the block, or if it's not valid
+    bool next(historySample &s);
+
+  private:
+    const historyBlock *block;
+    uint16_t pos;
+    uint8_t index;
+    historySample last;
+};
+
+//last blocks of a series, in RAM. Blocks are numbered from the first one: the newest is being filled,
+//the others are sealed and don't change anymore, until they are overwritten
+class historyRing {
+  public:
+    void add(const historySample &s);
+    //number of the block being filled
+    uint32_t current() const { return sealed; }
+    //oldest block still in RAM
+    uint32_t oldest() const { return sealed >= HISTORY_RING_BLOCKS - 1 ? sealed - (HISTORY_RING_BLOCKS - 1) : 0; }
+    //block by number, nullptr if overwritten or not there yet
+    const historyBlock* block(uint32_t n) const;
+    const historySample& newest() const { return last; }
+
+  private:
+    historyBlock blocks[HISTORY_RING_BLOCKS];
+    uint32_t sealed = 0; //blocks sealed so far
+    historySample last;
+};
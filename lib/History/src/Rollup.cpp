@@ -0,0 +1,79 @@
+#include "Rollup.h"
+
+const uint32_t rollupLengths[ROLLUP_WINDOWS] = {60, 3600, 86400};
+const char* const rollupNames[ROLLUP_WINDOWS] = {"minute", "hour", "day"};
+
+void rollup::open(uint8_t w, uint32_t time) {
+  rollupWindow &c = current[w];
+  c = rollupWindow();
+  c.start = time - time % rollupLengths[w];
+  for (uint8_t t = 0; t < ROLLUP_TEMPS; t++) {
+    c.min[t] = INT16_MAX;
+    c.max[t] = INT16_MIN;
+  }
+}
+
+void rollup::close(uint8_t w, uint32_t time) {
+  last[w] = current[w];
+  closed |= 1 << w;
+  open(w, time);
+}
+
+//values held from..to, split at window ends
+void rollup::hold(uint8_t w, uint32_t from, uint32_t to) {
+  while ( from < to ){
+    rollupWindow &c = current[w];
+    uint32_t end = c.start + rollupLengths[w];
+    if ( from >= end ){
+      close(w, from);
+      continue;
+    }
+    //a window opened by roll() meanwhile starts later
+    if ( from < c.start ){
+      from = c.start;
+      continue;
+    }
+    uint32_t part = (to < end ? to : end) - from;
+    c.covered += part;
+    for (uint8_t t = 0; t < ROLLUP_TEMPS; t++) {
+      c.sum[t] += (int32_t)prevTemps[t] * (int32_t)part;
+      if ( prevTemps[t] < c.min[t] ) c.min[t] = prevTemps[t];
+      if ( prevTemps[t] > c.max[t] ) c.max[t] = prevTemps[t];
+    }
+    if ( prevFreq > 0 ){
+      c.compressorOn += part;
+      c.load += (uint32_t)prevFreq * part;
+    }
+    from += part;
+  }
+}
+
+void rollup::add(uint32_t time, const int16_t temps[ROLLUP_TEMPS], uint8_t freq) {
+  if ( hasPrev && time > prevTime && time - prevTime <= ROLLUP_MAX_GAP ){
+    for (uint8_t w = 0; w < ROLLUP_WINDOWS; w++) {
+      hold(w, prevTime, time);
+    }
+  }
+  roll(time);
+  if ( hasPrev && prevFreq == 0 && freq > 0 ){
+    for (uint8_t w = 0; w < ROLLUP_WINDOWS; w++) {
+      current[w].starts++;
+    }
+  }
+  hasPrev = true;
+  prevTime = time;
+  for (uint8_t t = 0; t < ROLLUP_TEMPS; t++) {
+    prevTemps[t] = temps[t];
+  }
+  prevFreq = freq;
+}
+
+void rollup::roll(uint32_t time) {
+  for (uint8_t w = 0; w < ROLLUP_WINDOWS; w++) {
+    if ( current[w].start == 0 ){
+      open(w, time);
+    } else if ( time >= current[w].start + rollupLengths[w] ){
+      close(w, time);
+    }
+  }
+}
@@ -0,0 +1,61 @@
+/*
+Rolling aggregates of a unit's telemetry over minute, hour and day windows, at O(1) per sample.
+Values are held from one sample to the next, and each held stretch is added, time weighted, to the windows it falls in:
+min, max and mean of the temperatures, compressor on-time, compressor starts (short cycling shows up as many of them)
+and a load estimate, the compressor frequency integrated over time.
+Windows are aligned to the clock the samples are timed with, so days are local days if local time is used.
+*/
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+//temperatures aggregated: inside, outside, coil
+#define ROLLUP_TEMPS 3
+//a longer wait between samples is a hole in the data, not held values, s
+#define ROLLUP_MAX_GAP 300
+
+enum rollupWindowId : uint8_t { ROLLUP_MINUTE, ROLLUP_HOUR, ROLLUP_DAY, ROLLUP_WINDOWS };
+extern const uint32_t rollupLengths[ROLLUP_WINDOWS]; //s
+extern const char* const rollupNames[ROLLUP_WINDOWS];
+
+struct rollupWindow {
+  uint32_t start = 0; //s, 0 if never opened
+  uint32_t covered = 0; //s with data
+  int16_t min[ROLLUP_TEMPS];
+  int16_t max[ROLLUP_TEMPS];
+  int32_t sum[ROLLUP_TEMPS] = {}; //value * s
+  uint32_t compressorOn = 0; //s
+  uint16_t starts = 0; //compressor starts
+  uint32_t load = 0; //compressor frequency * s, Hz s
+
+  //rounded
+  int32_t mean(uint8_t t) const {
+    int32_t c = covered;
+    return c == 0 ? 0 : (sum[t] >= 0 ? sum[t] + c / 2 : sum[t] - c / 2) / c;
+  }
+};
+
+class rollup {
+  public:
+    //adds a sample, time in s
+    void add(uint32_t time, const int16_t temps[ROLLUP_TEMPS], uint8_t freq);
+    //closes the windows that are over, also when samples don't come
+    void roll(uint32_t time);
+    //forgets the last sample, the next one is not held back to it
+    void restart() { hasPrev = false; }
+
+    rollupWindow current[ROLLUP_WINDOWS]; //being filled
+    rollupWindow last[ROLLUP_WINDOWS]; //last closed
+    uint8_t closed = 0; //mask of windows closed since the application cleared it
+
+  private:
+    bool hasPrev = false;
+    uint32_t prevTime = 0;
+    int16_t prevTemps[ROLLUP_TEMPS] = {};
+    uint8_t prevFreq = 0;
+
+    void open(uint8_t w, uint32_t time);
+    void close(uint8_t w, uint32_t time);
+    void hold(uint8_t w, uint32_t from, uint32_t to);
+};
@@ -0,0 +1,1134 @@
+#include "S21.h"
+
+//ac variables
+const uint8_t modes[6] = {'1','2','3','4','6'};
+const uint8_t speeds[7] = {'A','3','4','5','6','7','B'};
+uint8_t modeToChar (uint8_t mode){
+  switch (mode){
+    case 49:
+      return modes[0];
+    case 50:
+      return modes[1];
+    case 51:
+      return modes[2];
+    case 52:
+      return modes[3];
+    case 54:
+      return modes[4];
+    default:
+      return 0;
+  }
+}
+uint8_t fanToChar (uint8_t speed){
+  switch (speed){
+    case 65:
+      return speeds[0];
+    case 51:
+      return speeds[1];
+    case 52:
+      return speeds[2];
+    case 53:
+      return speeds[3];
+    case 54:
+      return speeds[4];
+    case 55:
+      return speeds[5];
+    case 66:
+      return speeds[6];
+    default:
+      return 0;
+  }
+}
+//turns climate mode val to string
+const char* mode_to_string(uint8_t mode) {
+  switch (mode) {
+    case '0': //it seems it reports 0 when set to auto (1)
+    case '1':
+      return "Auto";
+    case '2':
+      return "Dry";
+    case '3':
+      return "Cool";
+    case '4':
+      return "Heat";
+    case '6':
+      return "Fan";
+    default:
+      return "UNKNOWN";
+  }
+}
+//turns fan mode val to string
+const char* speed_to_string(uint8_t mode) {
+  switch (mode) {
+    case 'A':
+      return "Auto";
+    case 'B':
+      return "Night";
+    case '3':
+      return "1";
+    case '4':
+      return "2";
+    case '5':
+      return "3";
+    case '6':
+      return "4";
+    case '7':
+      return "5";
+    default:
+      return "UNKNOWN";
+  }
+}
+
+//ac values fields access
+int32_t getField(const acStatus &values, uint8_t id) {
+  const void *value = (const uint8_t*)&values + acFields[id].offset;
+  switch (acFields[id].type) {
+    case FIELD_BOOL:
+      return *(const bool*)value;
+    case FIELD_U8:
+      return *(const uint8_t*)value;
+    case FIELD_I16:
+      return *(const int16_t*)value;
+    case FIELD_U16:
+      return *(const uint16_t*)value;
+  }
+  return 0;
+}
+void setField(acStatus &values, uint8_t id, int32_t val) {
+  void *value = (uint8_t*)&values + acFields[id].offset;
+  switch (acFields[id].type) {
+    case FIELD_BOOL:
+      *(bool*)value = val != 0;
+      break;
+    case FIELD_U8:
+      *(uint8_t*)value = val;
+      break;
+    case FIELD_I16:
+      *(int16_t*)value = val;
+      break;
+    case FIELD_U16:
+      *(uint16_t*)value = val;
+      break;
+  }
+}
+
+//registers affected by each command, read back after the ACK. Codes are concatenated
+struct acCommandEffect {
+  const char command[3];
+  const char *registers;
+};
+constexpr acCommandEffect acCommandEffects[] = {
+  {"D1", "F1RG"}, //power, mode, setpoint, fan
+  {"D5", "F5RM"}  //swing
+};
+
+//returns the bitmask of registers to read back after a command, all of them for unknown commands
+uint32_t commandConfirmMask(const uint8_t *command) {
+  for (const acCommandEffect &effect : acCommandEffects) {
+    if ( command[0] != effect.command[0] || command[1] != effect.command[1] ){
+      continue;
+    }
+    uint32_t mask = 0;
+    for (const char *reg = effect.registers; reg[0] && reg[1]; reg += 2) {
+      for (uint8_t i = 0; i < acRegistersCount; i++) {
+        if ( acRegisters[i].query[0] == reg[0] && acRegisters[i].query[1] == reg[1] ){
+          mask |= 1UL << i;
+        }
+      }
+    }
+    return mask;
+  }
+  return pollableMask();
+}
+
+//adds a latency sample
+void timingAdd(timingStats &t, uint32_t ms) {
+  uint8_t bucket = 0;
+  while ( bucket < TIMING_BUCKETS - 1 && ms >= timingEdges[bucket] ){
+    bucket++;
+  }
+  if ( t.hist[bucket] == UINT16_MAX ){
+    //aging the whole histogram, keeping its shape
+    for (uint8_t i = 0; i < TIMING_BUCKETS; i++) {
+      t.hist[i] /= 2;
+    }
+  }
+  t.hist[bucket]++;
+  if ( ms > maxTimeout ){
+    ms = maxTimeout;
+  }
+  if ( t.samples++ == 0 ){
+    t.srtt8 = ms * 8;
+    t.var4 = ms * 2;
+  } else {
+    int16_t err = ms - t.srtt8 / 8;
+    t.srtt8 += err;
+    t.var4 += abs(err) - t.var4 / 4;
+  }
+}
+//timed out waiting: backing off until the next sample
+void timingBackoff(timingStats &t) {
+  if ( t.samples > 0 ){
+    t.var4 = t.var4 * 2 > maxTimeout * 4 ? maxTimeout * 4 : t.var4 * 2;
+  }
+}
+//timeout for next wait, in ms
+uint16_t timingTimeout(const timingStats &t) {
+  if ( t.samples == 0 ){
+    return defaultTimeout;
+  }
+  //smoothed latency plus four deviations, plus two chars at 2400 baud
+  uint16_t timeout = t.srtt8 / 8 + t.var4 + 10;
+  return timeout < minTimeout ? minTimeout : (timeout > maxTimeout ? maxTimeout : timeout);
+}
+//ACK waits start when the request is all on the line, like the ACK timings: a write still leaving the FIFO isn't late
+static bool ackTimedOut(const s21RxState &rx, const timingStats &t) {
+  return (int32_t)(micros() - rx.writeTime) > (int32_t)timingTimeout(t) * 1000;
+}
+
+const char* const s21ErrorNames[ERR_CLASSES] = {"timeout", "nak", "unexpected", "checksum"};
+
+uint32_t pollAllocs = 0;
+bool pollPathActive = false;
+
+S21Port *s21Ports[S21_MAX_PORTS];
+uint8_t s21PortsCount = 0;
+
+S21Port::S21Port(s21Transport &serial, uint8_t id) : id(id), serial(serial) {
+  serial.port = this;
+  if ( s21PortsCount < S21_MAX_PORTS ){
+    s21Ports[s21PortsCount++] = this;
+  }
+}
+
+//Daikin AC Functions
+
+//calculates checksum
+uint8_t s21_checksum(const uint8_t *bytes, uint8_t len) {
+  uint8_t checksum = 0;
+  for (uint8_t i = 0; i < len; i++) {
+    checksum += bytes[i];
+  }
+  return checksum;
+}
+
+//turns bytes to num
+int16_t bytes_to_num(const uint8_t *bytes, size_t len) {
+  // <ones><tens><hundreds><neg/pos>
+  int16_t val = 0;
+  val = bytes[0] - '0';
+  val += (bytes[1] - '0') * 10;
+  val += (bytes[2] - '0') * 100;
+  if (len > 3 && bytes[3] == '-')
+    val *= -1;
+  return val;
+}
+
+//turns temp bytes to num
+int16_t temp_bytes_to_c10(const uint8_t *bytes) {
+  return bytes_to_num(bytes, 4);
+}
+
+//turn temperature num to bytes
+uint8_t c10_to_setpoint_byte(int16_t setpoint) {
+  return (setpoint + 3) / 5 + 28;
+}
+
+//turn bytes to HEX. Returns a static buffer, valid until next call
+const char* hex_repr(const uint8_t *bytes, size_t len) {
+  static char res[S21_FRAME_SIZE * 3 + 1];
+  size_t pos = 0;
+  for (size_t i = 0; i < len && pos + 3 < sizeof(res); i++) {
+    pos += sprintf(&res[pos], i > 0 ? ":%02X" : "%02X", bytes[i]);
+  }
+  res[pos] = '\0';
+  return res;
+}
+
+//turn bytes to string. Returns a static buffer, valid until next call
+const char* str_repr(const uint8_t *bytes, size_t len) {
+  static char res[S21_FRAME_SIZE * 4 + 1];
+  size_t pos = 0;
+  for (size_t i = 0; i < len && pos + 4 < sizeof(res); i++) {
+    char escape = 0;
+    switch (bytes[i]) {
+      case 7: escape = 'a'; break;
+      case 8: escape = 'b'; break;
+      case 9: escape = 't'; break;
+      case 10: escape = 'n'; break;
+      case 11: escape = 'v'; break;
+      case 12: escape = 'f'; break;
+      case 13: escape = 'r'; break;
+      case 27: escape = 'e'; break;
+      case 34: escape = '"'; break;
+      case 39: escape = '\''; break;
+      case 92: escape = '\\'; break;
+    }
+    if (escape) {
+      res[pos++] = '\\';
+      res[pos++] = escape;
+    } else if (bytes[i] < 32 || bytes[i] > 127) {
+      pos += sprintf(&res[pos], "\\x%02X", bytes[i]);
+    } else {
+      res[pos++] = bytes[i];
+    }
+  }
+  res[pos] = '\0';
+  return res;
+}
+
+//streaming frame recognizer: fed with every byte from split, finds ACK/NAK and full STX..ETX frames
+//complete frames are copied to frameBytes, checksum excluded
+void S21Port::s21RxPush(s21RxEvent event) {
+  uint8_t next = (s21Rx.eventHead + 1) % sizeof(s21Rx.events);
+  if ( next != s21Rx.eventTail ){
+    s21Rx.events[s21Rx.eventHead] = event;
+    s21Rx.eventHead = next;
+  }
+}
+s21RxEvent S21Port::s21RxPop() {
+  if ( s21Rx.eventHead == s21Rx.eventTail ){
+    return RX_NONE;
+  }
+  s21RxEvent event = (s21RxEvent)s21Rx.events[s21Rx.eventTail];
+  s21Rx.eventTail = (s21Rx.eventTail + 1) % sizeof(s21Rx.events);
+  return event;
+}
+void S21Port::s21RxReset() {
+  s21Rx.inFrame = false;
+  s21Rx.eventHead = s21Rx.eventTail = 0;
+}
+void S21Port::s21RxFeed(uint8_t b) {
+  s21Rx.lastByte = b;
+  s21Rx.lastByteTime = millis();
+  if ( !s21Rx.inFrame ){
+    if ( b == STX ){
+      s21Rx.inFrame = true;
+      s21Rx.len = 0;
+      s21Rx.frameStart = micros();
+    } else if ( b == ACK ){
+      s21Rx.ackTime = micros();
+      s21RxPush(RX_ACK);
+    } else if ( b == NAK ){
+      s21RxPush(RX_NAK);
+    } else {
+      s21RxPush(RX_UNEXPECTED);
+    }
+  } else if ( b == ETX ){
+    s21Rx.inFrame = false;
+    s21Rx.frameTime = micros();
+    rxStats.lastDuration = s21Rx.frameTime - s21Rx.frameStart;
+    if ( s21Rx.len < 3 ){
+      s21RxPush(RX_BAD_FRAME);
+      return;
+    }
+    //copying to frame buffer, without checksum
+    frameLen = s21Rx.len - 1;
+    memcpy(frameBytes, s21Rx.buf, frameLen);
+    s21Rx.frameChecksum = s21Rx.buf[frameLen];
+    if ( s21_checksum(frameBytes, frameLen) != s21Rx.frameChecksum ){
+      rxStats.badFrames++;
+      s21RxPush(RX_BAD_CHECKSUM);
+    } else {
+      rxStats.frames++;
+      s21RxPush(RX_FRAME);
+    }
+  } else if ( s21Rx.len < S21_FRAME_SIZE ){
+    s21Rx.buf[s21Rx.len++] = b;
+  } else {
+    s21Rx.inFrame = false;
+    rxStats.badFrames++;
+    s21RxPush(RX_BAD_FRAME);
+  }
+}
+
+void S21Port::write_frame(const uint8_t *frame, uint8_t len) {
+  //clearing serial buffer and anything pending in the recognizer
+  serial.discardInput();
+  s21RxReset();
+  //writing command to serial
+  serial.write(STX);
+  serial.write(frame, len);
+  debugD("Writing frame contents: %s", str_repr(frame, len));
+  serial.write(s21_checksum(frame, len));
+  serial.write(ETX);
+  s21Rx.writeTime = serial.sentTime();
+}
+
+//response decoders registry. Each entry decodes one value from a response frame into an ac field (or just logs it)
+enum acDecoderType : uint8_t {
+  DEC_NUM, //ascii decimal, reversed: <ones><tens><hundreds>[<sign>]. arg is the number of bytes, 0 for whole payload
+  DEC_TEMP, //signed temperature, reversed with sign
+  DEC_DIGIT, //single ascii digit
+  DEC_CHAR, //raw char
+  DEC_EQUALS, //true if the byte equals arg
+  DEC_BITS, //true if any of arg bits is set
+  DEC_ZERO, //true if the three digits are all '0'
+  DEC_SETPOINT //setpoint byte, only valid when mode has a setpoint
+};
+struct acDecoder {
+  char response[3]; //response code
+  uint8_t offset; //payload offset in frame
+  acDecoderType decoder;
+  uint8_t arg; //decoder argument
+  int8_t scale; //multiplier, divisor when negative
+  int8_t field; //destination field, -1 to only log the value
+  const char *name; //used to log values with no field
+};
+constexpr acDecoder acDecoders[] = {
+  {"G1", 2, DEC_EQUALS, '1', 1, AC_POWER, nullptr},
+  {"G1", 3, DEC_CHAR, 0, 1, AC_MODE, nullptr},
+  {"G1", 4, DEC_SETPOINT, 0, 5, AC_SETPOINT, nullptr}, //fan is taken from SG that has also night setting
+  {"G3", 2, DEC_DIGIT, 0, 1, -1, "Timer"},
+  {"G3", 3, DEC_DIGIT, 0, -6, -1, "ON timer hours"},
+  {"G3", 4, DEC_DIGIT, 0, -6, -1, "OFF timer hours"},
+  {"G5", 2, DEC_BITS, 1, 1, AC_SWING_V, nullptr},
+  {"G5", 2, DEC_BITS, 2, 1, AC_SWING_H, nullptr},
+  {"SH", 2, DEC_TEMP, 0, 1, AC_TEMP_INSIDE, nullptr},
+  {"SI", 2, DEC_TEMP, 0, 1, AC_TEMP_COIL, nullptr},
+  {"Sa", 2, DEC_TEMP, 0, 1, AC_TEMP_OUTSIDE, nullptr},
+  {"SL", 2, DEC_NUM, 0, 10, AC_FAN_RPM, nullptr},
+  {"Sd", 2, DEC_ZERO, 0, 1, AC_IDLE, nullptr},
+  {"Sd", 2, DEC_NUM, 3, 1, AC_COMPRESSOR_FREQ, nullptr},
+  {"SK", 2, DEC_NUM, 3, 10, AC_TARGET_FAN_RPM, nullptr},
+  {"SM", 2, DEC_NUM, 3, 1, AC_TARGET_ANGLE, nullptr},
+  {"SN", 2, DEC_NUM, 3, 1, AC_ANGLE, nullptr},
+  {"SG", 2, DEC_CHAR, 0, 1, AC_FAN, nullptr}, //fan speed with night mode
+  {"Sg", 2, DEC_DIGIT, 0, 1, -1, "Compressor state"},
+  {"SA", 2, DEC_DIGIT, 0, 1, -1, "Power state"},
+  {"SB", 2, DEC_DIGIT, 0, 1, -1, "Mode"},
+  {"SD", 2, DEC_NUM, 3, 10, -1, "Timer on minutes"},
+  {"SE", 2, DEC_NUM, 3, 10, -1, "Timer off minutes"},
+  {"SF", 2, DEC_DIGIT, 0, 1, -1, "Swing mode"},
+  {"SX", 2, DEC_NUM, 0, 1, -1, "Target temp"}
+};
+constexpr uint8_t acDecodersCount = sizeof(acDecoders) / sizeof(acDecoders[0]);
+
+//decodes a single value. Returns false if the value is not valid
+bool decodeValue(const acDecoder &dec, const acStatus &values, const uint8_t *bytes, uint8_t len, int32_t &val) {
+  //every decoder needs at least one byte, numbers need three
+  if ( dec.offset >= len || ((dec.decoder == DEC_NUM || dec.decoder == DEC_TEMP || dec.decoder == DEC_ZERO) && dec.offset + 3 > len) ){
+    return false;
+  }
+  const uint8_t *payload = &bytes[dec.offset];
+  switch (dec.decoder) {
+    case DEC_NUM:
+      val = bytes_to_num(payload, dec.arg ? dec.arg : len - dec.offset);
+      break;
+    case DEC_TEMP:
+      val = temp_bytes_to_c10(payload);
+      break;
+    case DEC_DIGIT:
+      val = payload[0] - '0';
+      break;
+    case DEC_CHAR:
+      val = payload[0];
+      break;
+    case DEC_EQUALS:
+      val = payload[0] == dec.arg;
+      break;
+    case DEC_BITS:
+      val = (payload[0] & dec.arg) != 0;
+      break;
+    case DEC_ZERO:
+      val = payload[0] == '0' && payload[1] == '0' && payload[2] == '0';
+      break;
+    case DEC_SETPOINT:
+      //only valid if mode is different from DRY and FAN
+      if ( values.mode == 50 || values.mode == 54 ){
+        return false;
+      }
+      val = payload[0] - 28;
+      break;
+  }
+  val = dec.scale < 0 ? val / -dec.scale : val * dec.scale;
+  return true;
+}
+
+//decodes a response frame through the registry, updating changed fields
+void S21Port::parseFrame(const uint8_t *bytes, uint8_t len) {
+  bool known = false;
+  for (uint8_t i = 0; i < acDecodersCount; i++) {
+    const acDecoder &dec = acDecoders[i];
+    if ( bytes[0] != dec.response[0] || bytes[1] != dec.response[1] ){
+      continue;
+    }
+    known = true;
+    int32_t val;
+    if ( !decodeValue(dec, acValues, bytes, len, val) ){
+      continue;
+    }
+    if ( dec.field < 0 ){
+      debugD("%s is %i", dec.name, val);
+    } else if ( getField(dec.field) != val ){
+      debugD("%s changed from %i to %i", acFields[dec.field].name, getField(dec.field), val);
+      setField(dec.field, val);
+      valueChanged = true;
+      valuesVersion++;
+      dirtyFields |= 1UL << dec.field;
+    } else {
+      debugD("%s is %i", acFields[dec.field].name, val);
+    }
+  }
+  if ( !known ){
+    if ( bytes[0] == 'S' && len > 5 ){
+      debugD("Unknown temp: %s -> %.1f C", str_repr(bytes, len), temp_bytes_to_c10(&bytes[2]) / 10.0);
+    } else {
+      debugW("Port %u: Unknown response %s ", id, str_repr(bytes, len));
+    }
+  }
+}
+
+//fills the command buffer
+void S21Port::set_command(std::initializer_list<uint8_t> bytes) {
+  acCommandLen = 0;
+  for (uint8_t b : bytes) {
+    if (acCommandLen < S21_FRAME_SIZE) {
+      acCommand[acCommandLen++] = b;
+    }
+  }
+}
+
+//actual scale of the poll intervals, in percent: tighter when someone is watching or the compressor runs, looser when the unit is off
+uint16_t S21Port::pollScale() {
+  uint16_t scale = 100;
+  if ( !acValues.power_on ){
+    scale = 200;
+  } else if ( !acValues.idle ){
+    scale = scale * 3 / 4;
+  }
+  if ( valuesWatched(*this) ){
+    scale = scale * 3 / 4;
+  }
+  return scale;
+}
+
+//actual poll interval of a register, in ms
+uint32_t S21Port::pollInterval(uint8_t reg) {
+  uint32_t interval = pollPeriod() * 1000UL * acRegisters[reg].interval / 100 * pollScale() / 100;
+  return interval < minPollInterval ? minPollInterval : interval;
+}
+
+//bitmask of polled registers: they have a poll interval and the unit supports them. Everything is polled until discovery is done
+uint32_t S21Port::supportedMask() {
+  return acCapabilitiesKnown ? pollableMask() & acCapabilities : pollableMask();
+}
+
+bool S21Port::acRegSupported(uint8_t reg) {
+  return supportedMask() & (1UL << reg);
+}
+
+//starts probing every known register
+void S21Port::startDiscovery() {
+  debugI("Port %u: Starting S21 capability discovery", id);
+  acProbeFound = 0;
+  acProbePending = allRegistersMask;
+  acProbePasses = probePasses;
+}
+
+//moves discovery on when a pass is over, and saves capabilities when done
+void S21Port::discoveryStep() {
+  if ( acProbePasses == 0 || acProbePending != 0 ){
+    return;
+  }
+  if ( --acProbePasses > 0 && (acProbeFound & allRegistersMask) != allRegistersMask ){
+    //another chance for registers that did not answer
+    acProbePending = allRegistersMask & ~acProbeFound;
+    return;
+  }
+  acProbePasses = 0;
+  acCapabilitiesKnown = true;
+  acCapabilities = acProbeFound;
+  saveCapabilities(*this);
+  debugI("Port %u: S21 capability discovery done: %08X", id, acCapabilities);
+  for (uint8_t i = 0; i < acRegistersCount; i++) {
+    debugI("  %s: %s", acRegisters[i].query, (acProbeFound & (1UL << i)) ? "supported" : "not supported");
+  }
+}
+
+//returns the index of the register that most needs a poll, or -1 if nothing is due
+int8_t S21Port::nextAcRegister() {
+  int8_t next = -1;
+  uint32_t nextOverdue = 0;
+  //discovery goes first
+  for (uint8_t i = 0; i < acRegistersCount && acProbePending; i++) {
+    if ( acProbePending & (1UL << i) ){
+      return i;
+    }
+  }
+  for (uint8_t i = 0; i < acRegistersCount; i++) {
+    uint32_t overdue;
+    if ( !acRegSupported(i) ){
+      continue;
+    }
+    if ( (acRegDemoted & (1UL << i)) && !(acRegForced & (1UL << i)) ){
+      if ( (int32_t)(millis() - acRegHealths[i].demotedUntil) < 0 ){
+        continue;
+      }
+      //demotion is over, one more chance
+      acRegDemoted &= ~(1UL << i);
+    }
+    if ( acRegForced & (1UL << i) ){
+      //forced registers win over anything else, and command read backs over the rest of a forced sweep
+      overdue = acConfirmPending & (1UL << i) ? UINT32_MAX : UINT32_MAX - 1;
+    } else {
+      uint32_t interval = pollInterval(i);
+      uint32_t elapsed = millis() - acRegLastPoll[i];
+      if ( elapsed < interval ){
+        continue;
+      }
+      //overdue ratio, weighted by priority
+      overdue = (elapsed - interval + 1) * acRegisters[i].priority;
+    }
+    if ( next < 0 || overdue > nextOverdue ){
+      next = i;
+      nextOverdue = overdue;
+    }
+  }
+  return next;
+}
+
+uint32_t S21Port::errorCount(s21Error err) {
+  uint32_t count = 0;
+  for (uint8_t i = 0; i < acRegistersCount; i++) {
+    count += acRegHealths[i].errors[err];
+  }
+  return count;
+}
+
+//counts an error of the actual query. Probes are not counted, unsupported registers are expected to fail
+void S21Port::countError(s21Error err) {
+  if ( !queryProbe ){
+    acRegHealths[acQuery].errors[err]++;
+  }
+}
+
+//the actual query failed: retrying it, or demoting the register if it keeps failing
+void S21Port::queryFailed() {
+  acRegHealth &h = acRegHealths[acQuery];
+  if ( queryProbe ){
+    //discovery has its own passes
+    return;
+  }
+  if ( acRetries < maxRetries ){
+    acRetries++;
+    h.retries++;
+    retryPending = true;
+    return;
+  }
+  acRetries = 0;
+  if ( h.failStreak < UINT8_MAX ){
+    h.failStreak++;
+  }
+  if ( h.failStreak >= demoteAfter ){
+    uint32_t time = demoteTime << min(h.failStreak - demoteAfter, 4);
+    h.demotions++;
+    h.demotedUntil = millis() + time;
+    acRegDemoted |= 1UL << acQuery;
+    debugW("Port %u: %s failed %u polls in a row, demoted for %lus", id, acRegisters[acQuery].query, h.failStreak, time / 1000);
+  }
+}
+
+void S21Port::dumpState() {
+  debugI("** BEGIN STATE (port %u) ***********************", id);
+  debugI("     Power: %i", acValues.power_on);
+  debugI("      Mode: %s", mode_to_string(acValues.mode));
+  debugI("    Target: %.1f C", acValues.setpoint / 10.0);
+  debugI("       Fan: %s (Target: %d rpm - actual: %d rpm)", speed_to_string(acValues.fan), acValues.target_fan_rpm, acValues.fan_rpm);
+  debugI("     Swing: H:%i V:%i", acValues.swing_h, acValues.swing_v);
+  debugI("    Inside: %.1f C", acValues.temp_inside / 10.0);
+  debugI("   Outside: %.1f C", acValues.temp_outside / 10.0);
+  debugI("      Coil: %.1f C", acValues.temp_coil / 10.0);
+  debugI("       Lid: Target: %d° - Actual: %d°", acValues.target_angle, acValues.angle);
+  debugI("Compressor: %s (%d Hz)", acValues.idle ? "idle" : "active", acValues.compressor_freq);
+  for (uint8_t i = 0; i < acRegistersCount; i++) {
+    if ( !acRegSupported(i) ){
+      continue;
+    }
+    if ( acRegLastRead[i] == 0 ){
+      debugI("        %s: never read (every %.1fs)", acRegisters[i].query, pollInterval(i) / 1000.0);
+    } else {
+      debugI("        %s: %.1fs old (every %.1fs)", acRegisters[i].query, (millis() - acRegLastRead[i]) / 1000.0, pollInterval(i) / 1000.0);
+    }
+    if ( acRegDemoted & (1UL << i) ){
+      debugI("            demoted for %lus more", (acRegHealths[i].demotedUntil - millis()) / 1000);
+    }
+  }
+  debugI("    Errors: %u timeout, %u NAK, %u unexpected, %u checksum", errorCount(ERR_TIMEOUT), errorCount(ERR_NAK), errorCount(ERR_UNEXPECTED), errorCount(ERR_CHECKSUM));
+  debugI("Poll allocs: %u", pollAllocs);
+  debugI("    Frames: %u good, %u bad. Last took %luus, parsed after %luus (max %luus)", rxStats.frames, rxStats.badFrames, rxStats.lastDuration, rxStats.lastLatency, rxStats.maxLatency);
+  debugI("** END STATE *****************************");
+}
+
+
+//poll states-machine: queries due registers and parses the answers
+void S21Port::pollStateMachine() {
+  //states-machine part
+  if ( state > 0 ){
+    pollPathActive = true;
+    if ( state == 1 ){ //state 1: sending query
+      //state of querying
+      if ( acQuery < acRegistersCount ){
+        //sending query
+        write_frame((const uint8_t*)acRegisters[acQuery].query, 2);
+        acRegLastPoll[acQuery] = millis();
+        acRegForced &= ~(1UL << acQuery);
+        queryProbe = retryPending ? queryProbe : (acProbePending & (1UL << acQuery)) != 0;
+        acProbePending &= ~(1UL << acQuery);
+        retryPending = false;
+        if ( !queryProbe ){
+          acRegHealths[acQuery].queries++;
+        }
+        txStart = millis();
+        queryOk = false;
+        //starting serial timeout counter
+        serialTimeoutStart = millis();
+        //going to next state
+        state = 2;
+      } else {
+        //no more registers due, let's go back to idle. Publishing is not part of the poll path
+        pollPathActive = false;
+        state = 0;
+        //resetting indes
+        acQuery = 0;
+        //showing values
+        dumpState();
+        publishValues(*this);
+        //and printing total time
+        updates++;
+        debugI("Port %u: Total update time: %.2fs", id, (millis()-updateStartTime)/1000.0);
+      }
+    } //end state 1: sending query
+    if ( state == 2 ){ //state 2: checking ACK
+      s21RxEvent event = s21RxPop();
+      if ( event == RX_NONE ){
+        if ( ackTimedOut(s21Rx, acRegTimings[acQuery].ack) ){
+          //got no answer! error, going to state 5 to wait for the next command
+          debugE("Port %u: Timeout waiting for ACK for query %s, timeout", id, acRegisters[acQuery].query);
+          timingBackoff(acRegTimings[acQuery].ack);
+          countError(ERR_TIMEOUT);
+          state = 5;
+        }
+      } else if ( event == RX_ACK ){
+        //good, now waiting for the frame
+        timingAdd(acRegTimings[acQuery].ack, (s21Rx.ackTime - s21Rx.writeTime) / 1000);
+        serialTimeoutStart = millis();
+        state = 3;
+      } else if ( event == RX_NAK ){
+        debugE("Port %u: NAK from S21 for %s query", id, acRegisters[acQuery].query);
+        countError(ERR_NAK);
+        //ko for this query, so going to state 5 to wait for the next command
+        state = 5;
+      } else {
+        debugE("Port %u: No ACK from S21 for %s query (received %i)", id, acRegisters[acQuery].query, s21Rx.lastByte);
+        countError(event == RX_BAD_CHECKSUM || event == RX_BAD_FRAME ? ERR_CHECKSUM : ERR_UNEXPECTED);
+        //ko for this query, so going to state 5 to wait for the next command
+        state = 5;
+      }
+    } //end state 2: checking ACK
+    if ( state == 3 ){ //state 3: reading frame
+      s21RxEvent event = s21RxPop();
+      if ( event == RX_NONE ){
+        //timeout restarts on every received byte
+        if ( (millis() - max(serialTimeoutStart, s21Rx.lastByteTime)) > timingTimeout(acRegTimings[acQuery].firstByte) ){
+          //got no answer! error, going to state 5 to wait for the next command
+          debugE("Port %u: Timeout waiting frame for query %s, timeout", id, acRegisters[acQuery].query);
+          timingBackoff(acRegTimings[acQuery].firstByte);
+          countError(ERR_TIMEOUT);
+          state = 5;
+        }
+      } else if ( event == RX_ACK ){
+        debugE("Port %u: Unexpected ACK waiting to read start of frame", id);
+        countError(ERR_UNEXPECTED);
+      } else if ( event == RX_UNEXPECTED || event == RX_NAK ){
+        debugE("Port %u: Unexpected byte waiting to read start of frame: %x", id, s21Rx.lastByte);
+        countError(ERR_UNEXPECTED);
+      } else if ( event == RX_BAD_FRAME ){
+        debugE("Port %u: Bad frame length for query %s", id, acRegisters[acQuery].query);
+        countError(ERR_CHECKSUM);
+        //as always, going to state 5 to wait for the next command
+        state = 5;
+      } else if ( event == RX_BAD_CHECKSUM ){
+        debugE("Port %u: Checksum mismatch: %x (frame) != %x (calc from %s)", id, s21Rx.frameChecksum, s21_checksum(frameBytes, frameLen), hex_repr(frameBytes, frameLen));
+        countError(ERR_CHECKSUM);
+        //as always, going to state 5 to wait for the next command
+        state = 5;
+      } else if ( event == RX_FRAME ){
+        //everything seems ok, let's go to next state and parse the frame!
+        debugD("Correctly received frame: %s - %s", hex_repr(frameBytes, frameLen), str_repr(frameBytes, frameLen));
+        timingAdd(acRegTimings[acQuery].firstByte, (s21Rx.frameStart - s21Rx.ackTime) / 1000);
+        timingAdd(acRegTimings[acQuery].frame, (s21Rx.frameTime - s21Rx.frameStart) / 1000);
+        state = 4;
+        //also sending an ACK to split
+        serial.write(ACK);
+      }
+    } //end state 3: reading frame
+    if ( state == 4 ){ //state 4: parse frame
+      //parsing frame and filling local vars if good
+      //for each value check if it has changed to limit network traffic over WS and MQTT
+      parseFrame(frameBytes, frameLen);
+      valuesParsed(*this);
+      acRegLastRead[acQuery] = millis();
+      acRegHealths[acQuery].failStreak = 0;
+      acRetries = 0;
+      if ( acProbePasses > 0 ){
+        acProbeFound |= 1UL << acQuery;
+      }
+      //a command is confirmed as soon as all of its registers are read back
+      if ( acConfirmPending & (1UL << acQuery) ){
+        acConfirmPending &= ~(1UL << acQuery);
+        if ( acConfirmPending == 0 ){
+          debugI("Port %u: Command confirmed in %lums", id, millis() - acConfirmStart);
+          //publishing is not part of the poll path
+          pollPathActive = false;
+          publishValues(*this);
+          pollPathActive = true;
+        }
+      }
+      //frame completion to parse latency
+      rxStats.lastLatency = micros() - s21Rx.frameTime;
+      if ( rxStats.lastLatency > rxStats.maxLatency ){
+        rxStats.maxLatency = rxStats.lastLatency;
+      }
+      queryOk = true;
+      //going to state to wait before next query
+      state = 5;
+    } //end state 4: parse frame
+    if ( state == 5 ){ //state 5: waiting
+      if ( !waiting ){
+        waitTimer = millis();
+        waiting = true;
+        busBusyMs += millis() - txStart;
+        //giving the split more room after errors, back to minimum slowly
+        if ( !queryOk ){
+          frameGap = frameGap * 2 > maxFrameGap ? maxFrameGap : frameGap * 2;
+          queryFailed();
+        } else if ( frameGap > minFrameGap ){
+          frameGap--;
+        }
+      } else {
+        if ( millis() - waitTimer > frameGap ){
+          //time to go back to business, with the failed query again or the next due register if any
+          waiting = false;
+          state = 1;
+          if ( !retryPending ){
+            discoveryStep();
+            int8_t next = nextAcRegister();
+            acQuery = next >= 0 ? next : acRegistersCount;
+          }
+        }
+      }
+    } //end state 5: waiting
+    pollPathActive = false;
+  } //end if state > 0
+}
+
+//commands states-machine: sends a command and waits for its ACK
+void S21Port::commandStateMachine() {
+  //we also have to manage commands! with a states-machine
+  if ( cmdState > 0 ){
+    if ( cmdState == 1 ){
+      //so we need to send a new command. Disable update and prepare sending new command
+      //if an update is en course, we need to wait some time to clear responses
+      if ( state > 0){
+        //so going to state 2 and wait a "serial Timeout time" before sending command
+        debugD("An update is en course, waiting a SERIALTIMEOUT before sending command");
+        cmdState = 2;
+        cmdWait = defaultTimeout;
+        serialTimeoutStart = millis();
+      } else {
+        //we can skip to state 3 to send command
+        cmdState = 3;
+      }
+      //a query in flight, or waiting for its retry, is asked again after the command: it was cut short, it didn't fail
+      if ( state > 0 && acQuery < acRegistersCount && (state == 2 || state == 3 || retryPending) ){
+        if ( queryProbe ){
+          acProbePending |= 1UL << acQuery;
+        } else {
+          acRegForced |= 1UL << acQuery;
+        }
+      }
+      if ( state == 2 || state == 3 ){
+        busBusyMs += millis() - txStart;
+      }
+      state = 0;
+      //the next wait starts over, with its frame gap and its error accounting
+      waiting = false;
+      //resetting indes, a pending retry is dropped too
+      acQuery = 0;
+      acRetries = 0;
+      retryPending = false;
+    } //end cmdState 1: disabling update and preparing sending new command
+    if ( cmdState == 2 ){ //cmdstate 2: waiting..
+      if ( millis() - serialTimeoutStart > cmdWait ){
+        //go to state 3
+        cmdState = 3;
+      }
+    } //end cmdstate 2: waiting
+    if ( cmdState == 3 ){ //cmdstate 3: sending command
+      debugD("Sending AC Command %s", str_repr(acCommand, acCommandLen));
+      //now sending command
+      write_frame(acCommand, acCommandLen);
+      //and wait for an ack!
+      serialTimeoutStart = txStart = millis();
+      cmdState = 4;
+    } //end cmdstate 3: sending command
+    if ( cmdState == 4 ){ //cmdstate 4: checking ACK
+      s21RxEvent event = s21RxPop();
+      if ( event == RX_NONE ){
+        if ( ackTimedOut(s21Rx, cmdAckTiming) ){
+          //got no answer! error, going to state 5 to wait for the next command
+          debugE("Port %u: Timeout waiting for ACK for command %s, timeout", id, str_repr(acCommand, acCommandLen));
+          timingBackoff(cmdAckTiming);
+          busBusyMs += millis() - txStart;
+          cmdState = 0;
+          //reading back what the command could have changed
+          acRegForced |= commandConfirmMask(acCommand) & supportedMask();
+          nextCommand();
+        }
+      } else {
+        //got an answer, check if it's an ACK
+        if (event == RX_NAK) {
+          debugE("Port %u: NAK from S21 for %s command", id, str_repr(acCommand, acCommandLen));
+        } else if (event != RX_ACK) {
+          debugE("Port %u: No ACK from S21 for %s command (received %i)", id, str_repr(acCommand, acCommandLen), s21Rx.lastByte);
+        } else {
+          debugI("Port %u: Command %s acknowledged", id, str_repr(acCommand, acCommandLen));
+          timingAdd(cmdAckTiming, (s21Rx.ackTime - s21Rx.writeTime) / 1000);
+        }
+        busBusyMs += millis() - txStart;
+        //command over, good or bad
+        cmdState = 0;
+        //reading back only what the command could have changed, publishing as soon as it's back
+        acConfirmPending |= commandConfirmMask(acCommand) & supportedMask();
+        acConfirmStart = millis();
+        acRegForced |= acConfirmPending;
+        //clearing command
+        acCommandLen = 0;
+        nextCommand();
+      }
+    } //end cmdstate 4: checking ack
+  } //end cmd state > 0
+}
+//second frame of an acSet, after a frame gap. Read backs wait until both are sent
+void S21Port::nextCommand() {
+  if ( acCommandNextLen == 0 ){
+    return;
+  }
+  memcpy(acCommand, acCommandNext, acCommandNextLen);
+  acCommandLen = acCommandNextLen;
+  acCommandNextLen = 0;
+  cmdWait = frameGap;
+  serialTimeoutStart = millis();
+  cmdState = 2;
+}
+
+//drains everything received from split into the frame recognizer
+void S21Port::receive() {
+  uint8_t buf[16];
+  int count;
+  serial.checkErrors();
+  while ( (count = serial.available()) > 0 ){
+    count = serial.read(buf, count > (int)sizeof(buf) ? sizeof(buf) : count);
+    for (int i = 0; i < count; i++) {
+      s21RxFeed(buf[i]);
+    }
+  }
+}
+
+//bytes received: draining all of them and moving the states-machines. Not for interrupt context, it logs and publishes
+void S21Port::onReceive() {
+  receive();
+  pollStateMachine();
+  commandStateMachine();
+}
+
+//one round of the engine, to be called as often as possible
+void S21Port::loop() {
+  //starting an update as soon as a register is due and the bus is free
+  if ( state == 0 && cmdState == 0 ) {
+    int8_t next = nextAcRegister();
+    if ( next >= 0 ){
+      debugD("Starting AC update.");
+      state = 1;
+      acQuery = next;
+      updateStartTime = millis();
+    }
+  }
+
+  //reading from split and running the states-machines. Transports with a receive callback do this from there too
+  onReceive();
+
+  //giving up on commands that could not be read back
+  if ( acConfirmPending && millis() - acConfirmStart > confirmTimeout ){
+    debugE("Port %u: Command not confirmed in %ums", id, confirmTimeout);
+    acConfirmPending = 0;
+  }
+
+  //bus duty cycle, over one minute windows
+  if ( millis() - busWindowStart > 60000UL ){
+    busDuty = busBusyMs * 1000 / (millis() - busWindowStart);
+    busBusyMs = 0;
+    busWindowStart = millis();
+  }
+}
+
+//ac commands, split by single command so to ease HA integration
+void S21Port::setAcPower(bool power) {
+  debugD("Sending AC Power: %i", power);
+
+  set_command({'D', '1',
+    (uint8_t)(power ? '1' : '0'),
+    (uint8_t) acValues.mode,
+    c10_to_setpoint_byte(acValues.setpoint),
+    (uint8_t) acValues.fan
+  });
+
+  //triggering send command
+  cmdState = 1;
+}
+void S21Port::setAcMode(uint8_t mode) {
+  debugD("Sending AC Mode: %s", mode_to_string(mode));
+
+  set_command({'D', '1',
+    (uint8_t)(acValues.power_on ? '1' : '0'),
+    (uint8_t) modeToChar(mode),
+    c10_to_setpoint_byte(acValues.setpoint),
+    (uint8_t) acValues.fan
+  });
+
+  //triggering send command
+  cmdState = 1;
+}
+//needed for HA integration: mode 0 is off
+void S21Port::setAcHaMode(uint8_t mode) {
+  if( mode == 0 ){
+    debugD("Turning AC power off.");
+    set_command({'D', '1',
+      (uint8_t)'0',
+      (uint8_t) acValues.mode,
+      c10_to_setpoint_byte(acValues.setpoint),
+      (uint8_t) acValues.fan
+    });
+  } else {
+    debugD("Turning power on and setting AC Mode: %s", mode_to_string(mode));
+    set_command({'D', '1',
+      (uint8_t)'1',
+      (uint8_t) modeToChar(mode),
+      c10_to_setpoint_byte(acValues.setpoint),
+      (uint8_t) acValues.fan
+    });
+  }
+
+  //triggering send command
+  cmdState = 1;
+}
+void S21Port::setAcFan(uint8_t fan) {
+  debugD("Sending AC Fan: %s", speed_to_string(fan));
+
+  set_command({'D', '1',
+    (uint8_t)(acValues.power_on ? '1' : '0'),
+    (uint8_t) acValues.mode,
+    c10_to_setpoint_byte(acValues.setpoint),
+    (uint8_t) fanToChar(fan)
+  });
+
+  //triggering send command
+  cmdState = 1;
+}
+//temp in degrees
+void S21Port::setAcTemp(int16_t temp) {
+  debugD("Sending AC TargetTemp: %i", temp);
+
+  set_command({'D', '1',
+    (uint8_t)(acValues.power_on ? '1' : '0'),
+    (uint8_t) acValues.mode,
+    c10_to_setpoint_byte(temp * 10),
+    (uint8_t) acValues.fan
+  });
+
+  //triggering send command
+  cmdState = 1;
+}
+void S21Port::setAcSwingV(bool swing) {
+  //swing control command
+  debugD("Sending AC Swing Vertical command: %i", swing);
+
+  set_command({'D', '5',
+    (uint8_t) ('0' + (acValues.swing_h ? 2 : 0) + (swing ? 1 : 0) + (acValues.swing_h && swing ? 4 : 0)),
+    (uint8_t) (swing || acValues.swing_h ? '?' : '0'),
+    '0', '0'
+  });
+
+  //triggering send command
+  cmdState = 1;
+}
+void S21Port::setAcSwingH(bool swing) {
+  //swing control command
+  debugD("Sending AC Swing Horizontal command: %i", swing);
+
+  set_command({'D', '5',
+    (uint8_t) ('0' + (swing ? 2 : 0) + (acValues.swing_v ? 1 : 0) + (swing && acValues.swing_v ? 4 : 0)),
+    (uint8_t) (acValues.swing_v || swing ? '?' : '0'),
+    '0', '0'
+  });
+  //triggering send command
+  cmdState = 1;
+}
+//many settings at once: at most one D1 and one D5 frame, built from the actual ac state and the settings given
+void S21Port::setAc(const acSettings &settings) {
+  auto has = [&](uint8_t field){ return (settings.fields & (1UL << field)) != 0; };
+  bool d1 = settings.fields & ((1UL << AC_POWER) | (1UL << AC_MODE) | (1UL << AC_FAN) | (1UL << AC_SETPOINT));
+  bool d5 = settings.fields & ((1UL << AC_SWING_V) | (1UL << AC_SWING_H));
+  if ( !d1 && !d5 ){
+    return;
+  }
+  acCommandNextLen = 0;
+  if ( d5 ){
+    bool swingV = has(AC_SWING_V) ? settings.swingV : acValues.swing_v;
+    bool swingH = has(AC_SWING_H) ? settings.swingH : acValues.swing_h;
+    debugD("Sending AC Swing: vertical %i, horizontal %i", swingV, swingH);
+    set_command({'D', '5',
+      (uint8_t) ('0' + (swingH ? 2 : 0) + (swingV ? 1 : 0) + (swingH && swingV ? 4 : 0)),
+      (uint8_t) (swingV || swingH ? '?' : '0'),
+      '0', '0'
+    });
+    if ( d1 ){
+      //swing goes second
+      memcpy(acCommandNext, acCommand, acCommandLen);
+      acCommandNextLen = acCommandLen;
+    }
+  }
+  if ( d1 ){
+    bool power = has(AC_POWER) ? settings.power : acValues.power_on;
+    uint8_t mode = has(AC_MODE) ? modeToChar(settings.mode) : acValues.mode;
+    uint8_t fan = has(AC_FAN) ? fanToChar(settings.fan) : acValues.fan;
+    int16_t setpoint = has(AC_SETPOINT) ? settings.temp * 10 : acValues.setpoint;
+    debugD("Sending AC Settings: power %i, mode %s, setpoint %i, fan %s", power, mode_to_string(mode), setpoint, speed_to_string(fan));
+    set_command({'D', '1',
+      (uint8_t)(power ? '1' : '0'),
+      mode,
+      c10_to_setpoint_byte(setpoint),
+      fan
+    });
+  }
+
+  //triggering send command
+  cmdState = 1;
+}
+
+//moves all ports
+void s21Loop() {
+  for (uint8_t i = 0; i < s21PortsCount; i++) {
+    s21Ports[i]->loop();
+  }
+}
+
+bool s21CommandsReady() {
+  for (uint8_t i = 0; i < s21PortsCount; i++) {
+    if ( !s21Ports[i]->commandReady() ){
+      return false;
+    }
+  }
+  return true;
+}
@@ -0,0 +1,349 @@
+/*
+S21 protocol engine: frame codec, response decoders, poll scheduler and commands states-machines.
+It does not depend on the ESP8266: split is reached through an s21Transport, and the application
+provides the few hooks declared at the bottom. This is what the native test environment builds.
+Each unit is an S21Port with its own values and states-machines, so one device can drive more units:
+ports never block, and s21Loop() moves all of them, so while a unit is thinking the others are talked to.
+*/
+#pragma once
+
+#include "S21Platform.h"
+
+//useful ac serial chars
+#define STX 2
+#define ETX 3
+#define ACK 6
+#define NAK 21
+//longest frame we accept, checksum included
+#define S21_FRAME_SIZE 32
+//max number of units driven by one device
+#define S21_MAX_PORTS 4
+
+//ac variables
+extern const uint8_t modes[6]; // auto, dry, cool, heat, fan -> in ASCII 49 50 51 52 54
+extern const uint8_t speeds[7]; //auto, speed from 1 to 5 and Night -> in ASCII 65 51 52 53 54 55 66
+uint8_t modeToChar(uint8_t mode);
+uint8_t fanToChar(uint8_t speed);
+const char* mode_to_string(uint8_t mode);
+const char* speed_to_string(uint8_t mode);
+
+//variables to store AC values
+struct acStatus {
+  bool power_on = false;
+  uint8_t mode = '1';
+  uint8_t fan = 'A';
+  int16_t setpoint = 270;
+  bool swing_v = false;
+  bool swing_h = false;
+  int16_t temp_inside = 0;
+  int16_t temp_outside = 0;
+  int16_t temp_coil = 0;
+  uint16_t target_fan_rpm = 0;
+  uint16_t fan_rpm = 0;
+  bool idle = true;
+  uint8_t compressor_freq = 0;
+  uint8_t target_angle = 0;
+  uint8_t angle = 0;
+};
+
+//ac values fields, with the name used in json messages
+enum acFieldType : uint8_t { FIELD_BOOL, FIELD_U8, FIELD_I16, FIELD_U16 };
+struct acField {
+  const char *name;
+  size_t offset; //in acStatus
+  acFieldType type;
+};
+enum acFieldId : uint8_t { AC_POWER, AC_MODE, AC_FAN, AC_SETPOINT, AC_SWING_V, AC_SWING_H, AC_TEMP_INSIDE, AC_TEMP_OUTSIDE, AC_TEMP_COIL,
+  AC_TARGET_FAN_RPM, AC_FAN_RPM, AC_IDLE, AC_COMPRESSOR_FREQ, AC_TARGET_ANGLE, AC_ANGLE, AC_FIELDS_COUNT };
+constexpr acField acFields[AC_FIELDS_COUNT] = {
+  {"power", offsetof(acStatus, power_on), FIELD_BOOL},
+  {"mode", offsetof(acStatus, mode), FIELD_U8},
+  {"fan", offsetof(acStatus, fan), FIELD_U8},
+  {"setpoint", offsetof(acStatus, setpoint), FIELD_I16},
+  {"swing_v", offsetof(acStatus, swing_v), FIELD_BOOL},
+  {"swing_h", offsetof(acStatus, swing_h), FIELD_BOOL},
+  {"temp_inside", offsetof(acStatus, temp_inside), FIELD_I16},
+  {"temp_outside", offsetof(acStatus, temp_outside), FIELD_I16},
+  {"temp_coil", offsetof(acStatus, temp_coil), FIELD_I16},
+  {"target_fan_rpm", offsetof(acStatus, target_fan_rpm), FIELD_U16},
+  {"fan_rpm", offsetof(acStatus, fan_rpm), FIELD_U16},
+  {"idle", offsetof(acStatus, idle), FIELD_BOOL},
+  {"compressor_freq", offsetof(acStatus, compressor_freq), FIELD_U8},
+  {"target_angle", offsetof(acStatus, target_angle), FIELD_U8},
+  {"angle", offsetof(acStatus, angle), FIELD_U8}
+};
+static_assert(AC_FIELDS_COUNT <= 32, "dirty fields bitmask is 32 bits");
+int32_t getField(const acStatus &values, uint8_t id);
+void setField(acStatus &values, uint8_t id, int32_t val);
+
+//poll scheduler: each register has its own base interval and priority
+struct acRegister {
+  const char query[3]; //ac query
+  uint16_t interval; //base poll interval, in percent of the poll period. 0 for registers only probed by discovery
+  uint8_t priority; //higher is polled first when more registers are due
+};
+constexpr acRegister acRegisters[] = {
+  {"F1", 200, 4}, //power, mode, setpoint
+  {"F5", 400, 1}, //swing
+  {"RH", 100, 3}, //inside temp
+  {"RI", 100, 3}, //coil temp
+  {"Ra", 200, 2}, //outside temp
+  {"RL",  50, 4}, //fan rpm
+  {"Rd",  50, 5}, //compressor
+  {"RK", 100, 3}, //target fan rpm
+  {"RM", 200, 1}, //target angle
+  {"RN", 200, 1}, //angle
+  {"RG", 200, 4}, //fan mode
+  //only probed, answers are logged
+  {"F3",   0, 0}, //timers
+  {"Rg",   0, 0}, //compressor state
+  {"RA",   0, 0}, //power state
+  {"RB",   0, 0}, //mode
+  {"RD",   0, 0}, //timer on
+  {"RE",   0, 0}, //timer off
+  {"RF",   0, 0}, //swing mode
+  {"RX",   0, 0}  //target temp
+};
+constexpr uint8_t acRegistersCount = sizeof(acRegisters) / sizeof(acRegisters[0]);
+static_assert(acRegistersCount <= 32, "registers bitmasks are 32 bits");
+constexpr uint32_t allRegistersMask = acRegistersCount == 32 ? UINT32_MAX : (1UL << acRegistersCount) - 1;
+//index of a register in the table, by query code. acRegistersCount if it's not there
+constexpr uint8_t registerIndex(const char *query, uint8_t i = 0) {
+  return i == acRegistersCount || (acRegisters[i].query[0] == query[0] && acRegisters[i].query[1] == query[1]) ? i : registerIndex(query, i + 1);
+}
+//FNV-1a of the query codes, in table order: bitmasks saved with another table don't index the same registers
+constexpr uint32_t registersHash(uint8_t i = 0, uint32_t h = 2166136261UL) {
+  return i == acRegistersCount ? h : registersHash(i + 1,
+    (uint32_t)(((uint32_t)((h ^ (uint8_t)acRegisters[i].query[0]) * 16777619UL) ^ (uint8_t)acRegisters[i].query[1]) * 16777619UL));
+}
+//bitmask of registers with a poll interval
+constexpr uint32_t pollableMask(uint8_t i = 0) {
+  return i == acRegistersCount ? 0 : ((acRegisters[i].interval > 0 ? 1UL << i : 0) | pollableMask(i + 1));
+}
+const uint32_t minPollInterval = 1000; //never poll a register more often than this, in ms
+const uint16_t confirmTimeout = 2000; //ms to wait for a command read back
+const uint8_t probePasses = 2; //discovery passes, a register has more chances to answer
+const uint8_t defaultTimeout = 100; //timeout waiting for serial byte, until timings are measured
+const uint8_t minFrameGap = 10, maxFrameGap = 100; //wait between frames, grows on errors
+
+//s21 timings: histograms and adaptive timeouts, like TCP retransmission timer
+#define TIMING_BUCKETS 8
+const uint16_t timingEdges[TIMING_BUCKETS - 1] = {5, 10, 20, 40, 80, 160, 320}; //buckets upper limits, in ms
+const uint8_t minTimeout = 30, maxTimeout = 250; //adaptive timeouts bounds, in ms
+struct timingStats {
+  uint16_t hist[TIMING_BUCKETS] = {};
+  uint32_t samples = 0;
+  uint16_t srtt8 = 0, var4 = 0; //smoothed latency (x8) and mean deviation (x4), in ms
+};
+struct acRegTiming {
+  timingStats ack; //query sent to ACK
+  timingStats firstByte; //ACK to STX
+  timingStats frame; //STX to ETX
+};
+void timingAdd(timingStats &t, uint32_t ms);
+void timingBackoff(timingStats &t);
+uint16_t timingTimeout(const timingStats &t);
+
+//query errors, by class. Checksum also counts frames with a bad length
+enum s21Error : uint8_t { ERR_TIMEOUT, ERR_NAK, ERR_UNEXPECTED, ERR_CHECKSUM, ERR_CLASSES };
+extern const char* const s21ErrorNames[ERR_CLASSES];
+//a failed query is retried right away, with the frame gap doubling in between. Registers failing every time are demoted for a while
+const uint8_t maxRetries = 2; //retries of a failed query
+const uint8_t demoteAfter = 3; //failed polls in a row, retries included, before a register is demoted
+const uint32_t demoteTime = 60000; //first demotion, in ms. Doubles on every failed poll after that, up to 16 times
+struct acRegHealth {
+  uint32_t queries = 0;
+  uint32_t errors[ERR_CLASSES] = {};
+  uint32_t retries = 0, demotions = 0;
+  uint8_t failStreak = 0; //failed polls in a row
+  uint32_t demotedUntil = 0;
+};
+
+//frame recognizer events, consumed by the states-machines
+enum s21RxEvent : uint8_t { RX_NONE, RX_ACK, RX_NAK, RX_UNEXPECTED, RX_FRAME, RX_BAD_CHECKSUM, RX_BAD_FRAME };
+//frame recognizer state and events not yet consumed by the states-machines
+struct s21RxState {
+  bool inFrame = false;
+  uint8_t buf[S21_FRAME_SIZE];
+  uint8_t len = 0;
+  uint8_t events[4];
+  uint8_t eventHead = 0, eventTail = 0;
+  uint8_t lastByte = 0, frameChecksum = 0;
+  uint32_t lastByteTime = 0; //ms, for timeouts
+  uint32_t writeTime = 0, ackTime = 0; //us, end of last write and ACK reception
+  uint32_t frameStart = 0, frameTime = 0; //us, STX and ETX reception
+};
+//receive path stats, times in us
+struct s21RxStats {
+  uint32_t frames = 0, badFrames = 0;
+  uint32_t lastDuration = 0; //STX to ETX
+  uint32_t lastLatency = 0, maxLatency = 0; //ETX to parsed
+};
+extern uint32_t pollAllocs; //heap allocations seen in the poll/parse path, should stay 0
+extern bool pollPathActive; //true while running the poll/parse states
+
+class S21Port;
+
+//s21 transport: the serial line to split
+class s21Transport {
+  public:
+    virtual void begin() = 0;
+    virtual int available() = 0;
+    virtual int read(uint8_t *buf, int len) = 0;
+    virtual void write(uint8_t b) = 0;
+    virtual void write(const uint8_t *buf, uint8_t len) = 0;
+    virtual void discardInput() = 0; //drops anything received and not read yet
+    virtual uint32_t sentTime() { return micros(); } //us, when the bytes written so far are all on the line. Writes that block are done on return
+    virtual void checkErrors() {} //samples line errors flags, called on every receive
+    virtual uint32_t errors() { return 0; } //line errors (parity, framing, overrun) detected by the transport
+    virtual const char* name() = 0;
+    S21Port *port = nullptr; //set by the port using this transport
+};
+
+//codec
+uint8_t s21_checksum(const uint8_t *bytes, uint8_t len);
+int16_t bytes_to_num(const uint8_t *bytes, size_t len);
+int16_t temp_bytes_to_c10(const uint8_t *bytes);
+uint8_t c10_to_setpoint_byte(int16_t setpoint);
+const char* hex_repr(const uint8_t *bytes, size_t len);
+const char* str_repr(const uint8_t *bytes, size_t len);
+uint32_t commandConfirmMask(const uint8_t *command);
+
+//settings changed together by S21Port::setAc: any subset of power, mode, fan, setpoint and swings.
+//What is not set is taken from the actual ac state, and the whole is sent as at most one D1 and one D5 frame
+struct acSettings {
+  uint32_t fields = 0; //bitmask of acFieldId, only the settings ones
+  bool power = false;
+  uint8_t mode = 0; //mode code, as setAcMode
+  uint8_t fan = 0; //fan code, as setAcFan
+  int16_t temp = 0; //setpoint in degrees, as setAcTemp
+  bool swingV = false, swingH = false;
+
+  void setPower(bool on) { power = on; fields |= 1UL << AC_POWER; }
+  void setMode(uint8_t code) { mode = code; fields |= 1UL << AC_MODE; }
+  //mode 0 is off, as setAcHaMode
+  void setHaMode(uint8_t code) {
+    setPower(code != 0);
+    if ( code != 0 ) setMode(code);
+  }
+  void setFan(uint8_t code) { fan = code; fields |= 1UL << AC_FAN; }
+  void setTemp(int16_t degrees) { temp = degrees; fields |= 1UL << AC_SETPOINT; }
+  void setSwingV(bool swing) { swingV = swing; fields |= 1UL << AC_SWING_V; }
+  void setSwingH(bool swing) { swingH = swing; fields |= 1UL << AC_SWING_H; }
+};
+
+//one S21 unit: values, poll scheduler and states-machines
+class S21Port {
+  public:
+    S21Port(s21Transport &serial, uint8_t id);
+
+    uint8_t id; //index in s21Ports
+    s21Transport &serial; //line to split
+    acStatus acValues;
+
+    //poll scheduler
+    uint32_t acRegLastPoll[acRegistersCount] = {}; //last time each register was queried
+    uint32_t acRegLastRead[acRegistersCount] = {}; //last time each register was read correctly
+    uint32_t acRegForced = 0; //bitmask of registers to poll as soon as possible
+    uint32_t acConfirmPending = 0; //bitmask of registers still to be read back after a command
+    uint32_t acConfirmStart = 0; //command ACK time
+    //capability discovery: every register is probed, and only the ones answering with a valid frame are polled afterwards
+    uint32_t acProbePending = 0; //registers still to probe in this discovery pass
+    uint32_t acProbeFound = 0; //registers that answered in this discovery
+    uint8_t acProbePasses = 0; //discovery passes left
+    uint32_t acCapabilities = 0; //registers supported by the unit, valid if acCapabilitiesKnown
+    bool acCapabilitiesKnown = false;
+    //error accounting, retries and demotion
+    acRegHealth acRegHealths[acRegistersCount];
+    uint32_t acRegDemoted = 0; //bitmask of registers not polled until their demotedUntil, unless forced
+    uint8_t acRetries = 0; //retries done for the actual query
+    bool retryPending = false, queryProbe = false; //actual query must be sent again / is a discovery probe
+
+    //variable and consts for states-machine
+    uint8_t state = 0, cmdState = 0; //machine state indexes
+    uint8_t acQuery = 0; //ac register index
+    uint32_t updateStartTime = 0, serialTimeoutStart = 0, waitTimer = 0; //used to calculate update time
+    uint8_t frameGap = minFrameGap; //wait between frames, grows on errors
+    bool queryOk = false; //last query got a good frame
+    bool waiting = false, valueChanged = false; //needed when waiting for next command
+    uint32_t valuesVersion = 0; //moves on whenever a value changes, for caches of acValues
+    uint32_t dirtyFields = 0; //bitmask of acFields changed since the application last cleared it
+
+    //timings and stats
+    acRegTiming acRegTimings[acRegistersCount];
+    timingStats cmdAckTiming; //command sent to ACK
+    uint32_t busBusyMs = 0, busWindowStart = 0, txStart = 0; //bus duty cycle, over one minute windows
+    uint16_t busDuty = 0; //per mille
+    uint32_t updates = 0; //poll cycles completed
+    s21RxStats rxStats;
+
+    //frames
+    s21RxState s21Rx;
+    uint8_t frameBytes[S21_FRAME_SIZE]; //buffer for frame reading
+    uint8_t frameLen = 0;
+    uint8_t acCommand[S21_FRAME_SIZE]; //buffer to hold commands
+    uint8_t acCommandLen = 0;
+    uint8_t acCommandNext[S21_FRAME_SIZE]; //second frame of an acSet, sent right after the first one
+    uint8_t acCommandNextLen = 0;
+    uint8_t cmdWait = defaultTimeout; //wait before sending, when an update or a command is on the line
+
+    //codec
+    void s21RxFeed(uint8_t b);
+    void write_frame(const uint8_t *frame, uint8_t len);
+    void parseFrame(const uint8_t *bytes, uint8_t len);
+    void set_command(std::initializer_list<uint8_t> bytes);
+
+    //scheduler
+    uint16_t pollScale();
+    uint32_t pollInterval(uint8_t reg);
+    uint32_t supportedMask();
+    bool acRegSupported(uint8_t reg);
+    void startDiscovery();
+    int8_t nextAcRegister();
+    uint32_t errorCount(s21Error err); //all registers together
+    void dumpState();
+
+    //engine
+    void receive();
+    void pollStateMachine();
+    void commandStateMachine();
+    void nextCommand(); //chains the second frame of an acSet
+    void onReceive(); //bytes received, can be called by the transport, outside of interrupts
+    void loop();
+    bool commandReady() { return cmdState == 0 && acConfirmPending == 0; } //a new command can be sent
+
+    //ac commands, built from the actual ac state and sent by the commands states-machine
+    void setAcPower(bool power);
+    void setAcMode(uint8_t mode);
+    void setAcHaMode(uint8_t mode);
+    void setAcFan(uint8_t fan);
+    void setAcTemp(int16_t temp);
+    void setAcSwingV(bool swing);
+    void setAcSwingH(bool swing);
+    void setAc(const acSettings &settings); //many settings, in one bus transaction per frame
+
+  private:
+    int32_t getField(uint8_t id) { return ::getField(acValues, id); }
+    void setField(uint8_t id, int32_t val) { ::setField(acValues, id, val); }
+    void s21RxPush(s21RxEvent event);
+    s21RxEvent s21RxPop();
+    void s21RxReset();
+    void discoveryStep();
+    void countError(s21Error err);
+    void queryFailed();
+};
+
+//all ports, in creation order
+extern S21Port *s21Ports[S21_MAX_PORTS];
+extern uint8_t s21PortsCount;
+//moves all ports
+void s21Loop();
+//true if no port is busy with a command
+bool s21CommandsReady();
+
+//provided by the application
+void publishValues(S21Port &port); //called at the end of an update and when a command is confirmed
+void valuesParsed(S21Port &port); //called after each frame is parsed, in the poll path: short and no allocations
+bool valuesWatched(S21Port &port); //true if someone is looking at values, polls get tighter
+uint8_t pollPeriod(); //base poll period, in seconds
+void saveCapabilities(S21Port &port); //discovery is done, acCapabilities can be persisted
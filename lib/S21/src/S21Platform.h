@@ -0,0 +1,39 @@
+/*
+Platform glue for the S21 engine.
+On the ESP8266 it's the Arduino core and RemoteDebug, on the native build clock and logging
+are provided by the test harness, so that time can be simulated.
+*/
+#pragma once
+
+#ifdef ARDUINO
+#include <Arduino.h>
+#include "RemoteDebug.h"
+extern RemoteDebug Debug;
+#else
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <initializer_list>
+using std::max;
+using std::min;
+
+//virtual clock, provided by the test harness
+uint32_t millis();
+uint32_t micros();
+
+//debug output goes to stdout only if S21_NATIVE_DEBUG is defined
+#ifdef S21_NATIVE_DEBUG
+#define S21_LOG(level, fmt, ...) printf("[%8u] (" level ") " fmt "\n", millis(), ##__VA_ARGS__)
+#else
+#define S21_LOG(level, fmt, ...) do {} while (0)
+#endif
+#define debugV(fmt, ...) S21_LOG("V", fmt, ##__VA_ARGS__)
+#define debugD(fmt, ...) S21_LOG("D", fmt, ##__VA_ARGS__)
+#define debugI(fmt, ...) S21_LOG("I", fmt, ##__VA_ARGS__)
+#define debugW(fmt, ...) S21_LOG("W", fmt, ##__VA_ARGS__)
+#define debugE(fmt, ...) S21_LOG("E", fmt, ##__VA_ARGS__)
+#define debugA(fmt, ...) S21_LOG("A", fmt, ##__VA_ARGS__)
+#endif
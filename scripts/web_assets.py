@@ -0,0 +1,62 @@
+# Gzipped, content-hashed web assets, built in data/ right before the filesystem image (pio run -t buildfs / uploadfs).
+# For each asset <file>.gz is written, and a line "<url> <file> <hash>" in assets.txt: the firmware serves <file>.gz
+# on <url> with the hash as strong ETag. Assets in HASHED are served on a name with the hash in it, cached for good,
+# and index.html is rewritten to point to those names. Plain files stay in the image, as a fallback
+Import("env")
+
+import gzip
+import hashlib
+import os
+
+HASHED = ["daikin.js"]
+PLAIN = {"index.html": "/", "favicon.ico": "/favicon.ico"}
+
+
+def content_hash(content):
+    return hashlib.sha256(content).hexdigest()[:8]
+
+
+def write_gz(path, content):
+    #mtime fixed, same input same bytes
+    with open(path, "wb") as f:
+        f.write(gzip.compress(content, compresslevel=9, mtime=0))
+
+
+def build_assets(source, target, env):
+    data = env.subst("$PROJECT_DATA_DIR")
+    for name in os.listdir(data):
+        if name.endswith(".gz") or name == "assets.txt":
+            os.remove(os.path.join(data, name))
+
+    manifest = []
+    renames = {}
+    for name in HASHED:
+        with open(os.path.join(data, name), "rb") as f:
+            content = f.read()
+        h = content_hash(content)
+        base, ext = os.path.splitext(name)
+        renames[name] = "%s.%s%s" % (base, h, ext)
+        write_gz(os.path.join(data, name + ".gz"), content)
+        manifest.append("/%s /%s %s" % (renames[name], name, h))
+
+    for name, url in PLAIN.items():
+        with open(os.path.join(data, name), "rb") as f:
+            content = f.read()
+        if name.endswith(".html"):
+            for old, new in renames.items():
+                content = content.replace(('"%s"' % old).encode(), ('"%s"' % new).encode())
+        write_gz(os.path.join(data, name + ".gz"), content)
+        manifest.append("%s /%s %s" % (url, name, content_hash(content)))
+
+    with open(os.path.join(data, "assets.txt"), "w") as f:
+        f.write("\n".join(manifest) + "\n")
+    print("Web assets: " + ", ".join(manifest))
+
+
+#a post: script (see platformio.ini). ESP8266_FS_IMAGE_NAME is set by the platform builder, that runs after pre: scripts:
+#hooked from one of them, the target would be "$BUILD_DIR/.bin" and the assets never built.
+#uploadfs depends on the same image, so both targets get the assets
+fs_image = env.subst("$BUILD_DIR/${ESP8266_FS_IMAGE_NAME}.bin")
+if not env.get("ESP8266_FS_IMAGE_NAME"):
+    print("Web assets: ESP8266_FS_IMAGE_NAME not set, gzipped assets will not be built")
+env.AddPreAction(fs_image, build_assets)
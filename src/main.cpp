@@ -29,6 +29,50 @@ Also moved under struct the local state vars, for cleaner code
 - using different commands for target fan speed - split for 9000btu and 12000 btu units - the web interface shows the fan speed selected by auto mode (yes, i was getting bored lol)
 - added night mode management for fan, in code, in web interface and in HA
 
+1.4
+- registers are polled by a scheduler, each with its own interval (relative to config period) and priority. Intervals are tighter when
+  someone is watching (WS or MQTT) or the compressor is running, looser when the unit is off. Registers age is in the state dump
+- s21 frames use fixed buffers and a constexpr query table, no heap allocations in the poll path. An allocation counter is in the state dump
+- serial receive drains all pending bytes into a streaming frame recognizer, and the states-machines run on all of them at once.
+  The software serial receive callback does the same, but it's a scheduled function run after each loop(), not an interrupt
+  Frame duration and frame to parse latency are in the state dump and /metrics. That latency still follows loop timing
+- responses are decoded through a registry of decoders, one entry per value, with generic change detection
+- commands from WS, HTTP and MQTT go through bounded per-source queues, worked round-robin when the command states-machine is free
+- after a command only the registers it affects are read back, and values are published as soon as they are
+- s21 timeouts and frame gap adapt to measured latencies. Latency histograms and bus duty cycle are in remote debug and web interface
+- registers supported by the unit are discovered on first boot (or on demand) and saved, only those are polled
+- s21 serial is behind a transport interface. Software serial by default, hardware UART on swapped pins with S21_TRANSPORT_HWUART
+- s21 engine moved to lib/S21, tested natively against a simulated unit (pio test -e native)
+- sensor values are serialized once per change, and the same buffer is sent to WS clients, MQTT and /state
+- mqtt: every value on its own retained topic (<pubTopic>/<field>), published only when it changes, plain value commands
+  on <pubTopic>/<field>/set, and Home Assistant discovery. JSON commands on subTopic are still accepted
+- telemetry is filtered before publishing: per field dead-bands, and min/max publish intervals for WS and mqtt, set with the
+  config command. State changes (power, mode, fan, setpoint, swing, compressor) are always sent right away
+- WS clients get the full sensor message on connect (or on "resync"), then only changed fields in "delta" messages with a sequence number
+- failed queries are retried right away with a growing frame gap, registers that keep failing are demoted for a while.
+  Errors are counted per register and per class (timeout, NAK, unexpected byte, checksum), in remote debug and web interface
+- up to 3 S21 ports (S21_PORTS), one engine instance per unit, interleaved on the same loop. Port 0 keeps the old topics,
+  port n publishes and subscribes on <topic>/n. WS, HTTP and MQTT commands take an optional "port"
+- /state has a weak ETag (per boot random salt and values version) and answers 304 to a matching If-None-Match. With ?since=<version>&wait=<s>
+  it's a long-poll: held until values move on from that version (X-State-Version header) or the wait is over
+- server-sent events on /events, for integrations that only read: sensor, rssi and config messages, as events of that
+  type. Last-Event-ID resumes with only what was missed. Up to 4 streams, same authentication as the web page
+- web assets are gzipped and content-hashed on uploadfs (scripts/web_assets.py) and served with strong ETags: daikin.js
+  on a hashed name, cached for a year, the page and icon revalidated. Plain files are the fallback
+- telemetry history: a sample a minute of temperatures, compressor frequency, fan rpm, power and mode, delta-encoded
+  in RAM (lib/History) and appended block by block to a rotating file per port, a few days of it. /history streams
+  it as CSV or JSON (?from=&to=&fields=&format=json), the web page draws the last 24 hours from it
+- WS clients can switch to MessagePack: after a binary MessagePack frame (a {"command":"hello"} is enough) every message
+  to that client is a binary MessagePack frame, serialized once per format in use. JSON text clients are unchanged
+- rollups of temperatures (min, max, mean) and compressor on-time, starts and load over minute, hour and local day
+  windows, updated on every parsed frame (valuesParsed hook) and published retained on <pubTopic>/stats/<window>
+- acSet command (WS, HTTP, mqtt JSON) with any of power, mode, haMode, temp, fan, swingV and swingH, sent as at most one
+  D1 and one D5 frame. Arrays of commands are accepted too, their ac settings are merged the same way
+- /metrics in Prometheus text format: loop() duration histogram, time per subsystem and longest stall, poll cycles per
+  hour, frames and bus duty per port, free heap, max free block and fragmentation
+- inbound commands are parsed into a preallocated document and dispatched on compile-time hashes of command and config
+  target names, without heap Strings. Time and allocations per command are in /metrics and in the cmdqueue dump
+
 */
 #include <Arduino.h>
 #include <ESP8266WiFi.h>
@@ -47,6 +91,9 @@ Also moved under struct the local state vars, for cleaner code
 #include <ESPAsyncWiFiManager.h>
 #include <LittleFS.h>
 #include <FS.h>
+#include <S21.h>
+#include <History.h>
+#include <Rollup.h>
 
 /* Useful Constants */
 #define SECS_PER_MIN  (60UL)
@@ -60,131 +107,16 @@ Also moved under struct the local state vars, for cleaner code
 
 const char* apname = "WiFi-daikin"; //name used for config AP when wifi is not found
 
-//ac variables
-const uint8_t modes[6] = {'1','2','3','4','6'}; // auto, dry, cool, heat, fan -> in ASCII 49 50 51 52 54
-const uint8_t speeds[7] = {'A','3','4','5','6','7','B'}; //auto, speed from 1 to 5 and Night -> in ASCII 65 51 52 53 54 55 66
-std::uint8_t modeToChar (uint8_t mode){
-  switch (mode){
-    case 49:
-      return modes[0];
-    case 50:
-      return modes[1];
-    case 51:
-      return modes[2];
-    case 52:
-      return modes[3];
-    case 54:
-      return modes[4];
-    default:
-      return 0;
-  }
-}
-std::uint8_t fanToChar (uint8_t speed){
-  switch (speed){
-    case 65:
-      return speeds[0];
-    case 51:
-      return speeds[1];
-    case 52:
-      return speeds[2];
-    case 53:
-      return speeds[3];
-    case 54:
-      return speeds[4];
-    case 55:
-      return speeds[5];
-    case 66:
-      return speeds[6];
-    default:
-      return 0;
-  }
-}
-//turns climate mode val to string
-std::string mode_to_string(uint8_t mode) {
-  switch (mode) {
-    case '0': //it seems it reports 0 when set to auto (1)
-    case '1':
-      return "Auto";
-    case '2':
-      return "Dry";
-    case '3':
-      return "Cool";
-    case '4':
-      return "Heat";
-    case '6':
-      return "Fan";
-    default:
-      return "UNKNOWN";
-  }
-}
-//turns fan mode val to string
-std::string speed_to_string(uint8_t mode) {
-  switch (mode) {
-    case 'A':
-      return "Auto";
-    case 'B':
-      return "Night";
-    case '3':
-      return "1";
-    case '4':
-      return "2";
-    case '5':
-      return "3";
-    case '6':
-      return "4";
-    case '7':
-      return "5";
-    default:
-      return "UNKNOWN";
-  }
-}
-
-//useful ac serial chars
-#define STX 2
-#define ETX 3
-#define ACK 6
-#define NAK 21
-
-//variables to store AC values
-struct {
-  bool power_on = false;
-  uint8_t mode = '1';
-  uint8_t fan = 'A';
-  int16_t setpoint = 270;
-  bool swing_v = false;
-  bool swing_h = false;
-  int16_t temp_inside = 0;
-  int16_t temp_outside = 0;
-  int16_t temp_coil = 0;
-  uint16_t target_fan_rpm = 0;
-  uint16_t fan_rpm = 0;
-  bool idle = true;
-  uint8_t compressor_freq = 0;
-  uint8_t target_angle = 0;
-  uint8_t angle = 0;
-} acValues;
-
-//variable and consts for states-machine
-const std::vector<std::string> acQueries = {"F1", "F5", "RH", "RI", "Ra", "RL", "Rd", "RK", "RM", "RN", "RG"}; //list of good used ac queries
-uint8_t state = 0, cmdState = 0; //machine state indexes
-uint8_t acQuery = 0; //ac query index
-uint32_t updateStartTime = 0, serialTimeoutStart = 0, waitTimer = 0; //used to calculate update time
-const uint8_t serialTimeout = 100, waitTimeout = 10; //timeout waiting for serial byte or for next command
-std::vector<uint8_t> frameBytes = {}; //buffer for frame reading
-bool frameReading = false, waiting = false, STXreceived = false, valueChanged = false; //needed when reading a full frame or waiting for next command or checking STX byte
-uint8_t serialByte = 0; //buffer for single bytes read
-uint8_t frameChecksum = 0, calcChecksum = 0;
-std::vector<uint8_t> acCommand = {}; //vector to hold commands
 bool resetNeeded = false; //used to recall the need for a reset when changing relevant settings
 
 //general vars
 WiFiClient espClient;
 PubSubClient mqttClient(espClient);
-StaticJsonDocument<512> jsonDoc, lastReading; //json var
 Timezone daikinTz;
 RemoteDebug Debug;
 AsyncWebServer server(80);
 AsyncWebSocket ws("/ws");
+AsyncEventSource events("/events");
 DNSServer dns;
 AsyncWiFiManager wifiConnManager(&server,&dns);
 
@@ -208,21 +140,563 @@ struct {
   char mqttPubTopic[64];   //mqtt topic to publish data to
   
   uint8_t period; //reading period, in seconds
+
+  //s21 registers supported by each unit, found by discovery, one bit per acRegisters entry. Valid if check is 112
+  //(111 was the single port layout) and capabilitiesTable matches the table
+  uint8_t capabilitiesCheck[S21_MAX_PORTS];
+  uint32_t capabilities[S21_MAX_PORTS];
+
+  //telemetry filtering. Valid if check is 113, a marker of its own so that stale bytes left by other layouts do not pass
+  uint8_t filterCheck;
+  uint16_t deadBand[AC_FIELDS_COUNT]; //smallest change worth publishing, in field units (tenths of C for temperatures). 0 is any
+  uint16_t wsMinInterval, wsMaxInterval; //seconds between telemetry updates to WS clients: at least min, and at most max (0 is never)
+  uint16_t mqttMinInterval, mqttMaxInterval; //same, for mqtt
+
+  //registersHash of the table the capabilities bitmaps were discovered with. Last, so the layout above doesn't move
+  uint32_t capabilitiesTable;
 } config;
 
-//software serial to control split
-EspSoftwareSerial::UART daikinSWSerial;
+//number of s21 ports, one unit each. Selected at build time with S21_PORTS (see platformio.ini)
+#ifndef S21_PORTS
+#define S21_PORTS 1
+#endif
+static_assert(S21_PORTS >= 1 && S21_PORTS <= 3, "S21_PORTS must be 1 to 3");
+
+//s21 transport: the serial line to split. Selected at build time with S21_TRANSPORT_HWUART (see platformio.ini)
+//only port 0 can be on the hardware UART, other ports are always on software serial
+
+#ifdef S21_TRANSPORT_HWUART
+//hardware UART0 swapped to GPIO13 (RX, D7) and GPIO15 (TX, D8). Logging goes to Serial1 (TX only, GPIO2/D4) and telnet
+#define logSerial Serial1
+class s21HwUart : public s21Transport {
+  public:
+    void begin() override {
+      Serial.begin(2400, SERIAL_8E2);
+      Serial.swap();
+      //no core or SDK messages on the bus
+      Serial.setDebugOutput(false);
+    }
+    int available() override { return Serial.available(); }
+    int read(uint8_t *buf, int len) override { return Serial.read((char*)buf, len); }
+    void write(uint8_t b) override { Serial.write(b); }
+    void write(const uint8_t *buf, uint8_t len) override { Serial.write(buf, len); }
+    void discardInput() override {
+      while ( Serial.available() > 0 ){
+        Serial.read();
+      }
+    }
+    //writes only fill the TX FIFO: what is still in there leaves one byte every 5 ms (12 bits at 2400 baud)
+    uint32_t sentTime() override {
+      return micros() + (UART_TX_FIFO_SIZE - Serial.availableForWrite()) * 5000UL;
+    }
+    void checkErrors() override {
+      if ( Serial.hasRxError() ) lineErrors++;
+      if ( Serial.hasOverrun() ) lineErrors++;
+    }
+    uint32_t errors() override { return lineErrors; }
+    const char* name() override { return "hwuart"; }
+  private:
+    uint32_t lineErrors = 0;
+};
+s21HwUart hwSerial;
+#else
+#define logSerial Serial
+#endif
+//software serial, open drain
+class s21SwSerial : public s21Transport {
+  public:
+    s21SwSerial(int8_t rxPin, int8_t txPin) : rxPin(rxPin), txPin(txPin) {}
+    void begin() override {
+      uart.enableTxGPIOOpenDrain(true);
+      uart.begin(2400, EspSoftwareSerial::SWSERIAL_8E2, rxPin, txPin, false);
+      uart.setTimeout(1000);
+      //draining bytes and moving the states-machines of the port when something was received. EspSoftwareSerial runs this
+      //with schedule_function, once after each loop(): one more pass, not interrupt time, so it still depends on loop timing
+      uart.onReceive([this](){
+        if ( port ) port->onReceive();
+      });
+    }
+    int available() override { return uart.available(); }
+    int read(uint8_t *buf, int len) override { return uart.read(buf, len); }
+    void write(uint8_t b) override { uart.write(b); }
+    void write(const uint8_t *buf, uint8_t len) override { uart.write(buf, len); }
+    void discardInput() override { uart.flush(); } //EspSoftwareSerial's flush drops the receive buffer
+    void checkErrors() override {
+      if ( uart.overflow() ) overflows++;
+    }
+    uint32_t errors() override { return overflows; }
+    const char* name() override { return "swserial"; }
+  private:
+    int8_t rxPin, txPin;
+    EspSoftwareSerial::UART uart;
+    uint32_t overflows = 0;
+};
+
+//ports, in index order. Port 0 on D7 (RX) and D6 (TX), or on the hardware UART
+#ifdef S21_TRANSPORT_HWUART
+S21Port port0(hwSerial, 0);
+#else
+s21SwSerial swSerial0(D7, D6);
+S21Port port0(swSerial0, 0);
+#endif
+#if S21_PORTS > 1
+//port 1 on D5 (RX) and D2 (TX)
+s21SwSerial swSerial1(D5, D2);
+S21Port port1(swSerial1, 1);
+#endif
+#if S21_PORTS > 2
+//port 2 on D1 (RX) and D3 (TX). D3 must not be pulled low at boot, open drain TX is idle high
+s21SwSerial swSerial2(D1, D3);
+S21Port port2(swSerial2, 2);
+#endif
+
+//returns the port with the given index, or nullptr
+S21Port* s21Port(uint8_t id) {
+  return id < s21PortsCount ? s21Ports[id] : nullptr;
+}
+
+//loop iterations and frames per second, all ports together, over one minute windows: a rough measure of CPU left for the rest
+//and of the gateway throughput
+uint32_t loopCount = 0, framesTotal = 0, statsWindowStart = 0;
+uint16_t loopRate = 0, frameRate = 0;
+
+//heap allocations counters for the poll path and for inbound commands: malloc, realloc and calloc are wrapped at
+//link time (see build_flags). Note that debug output allocates too, so this is meaningful with debug level set to info or higher
+bool cmdPathActive = false; //true while parsing and dispatching a command
+uint32_t cmdClient = 0; //WS client of the command being worked, 0 if none
+uint32_t cmdAllocs = 0, cmdCount = 0;
+uint64_t cmdUs = 0; //time spent parsing and dispatching commands
+extern "C" {
+  void* __real_malloc(size_t size);
+  void* __real_realloc(void *ptr, size_t size);
+  void* __real_calloc(size_t count, size_t size);
+  void* __wrap_malloc(size_t size) {
+    if ( pollPathActive ) pollAllocs++;
+    if ( cmdPathActive ) cmdAllocs++;
+    return __real_malloc(size);
+  }
+  void* __wrap_realloc(void *ptr, size_t size) {
+    if ( pollPathActive ) pollAllocs++;
+    if ( cmdPathActive ) cmdAllocs++;
+    return __real_realloc(ptr, size);
+  }
+  void* __wrap_calloc(size_t count, size_t size) {
+    if ( pollPathActive ) pollAllocs++;
+    if ( cmdPathActive ) cmdAllocs++;
+    return __real_calloc(count, size);
+  }
+}
+
+//loop timing, always on: iteration durations histogram, time spent per subsystem and the longest stall with the
+//subsystem that took most of it. A micros() read per section, served on /metrics with poll rates and heap
+enum loopSection : uint8_t { SEC_S21, SEC_COMMANDS, SEC_TELEMETRY, SEC_CLIENTS, SEC_TIME, SEC_OTA, SEC_DEBUG, SEC_MQTT, SEC_COUNT };
+const char* loopSectionNames[SEC_COUNT] = {"s21", "commands", "telemetry", "clients", "time", "ota", "debug", "mqtt"};
+#define LOOP_BUCKETS 8
+const uint32_t loopEdges[LOOP_BUCKETS - 1] = {100, 500, 1000, 5000, 10000, 50000, 100000}; //buckets upper limits, in us
+struct {
+  uint32_t hist[LOOP_BUCKETS] = {};
+  uint64_t totalUs = 0, sectionUs[SEC_COUNT] = {};
+  uint32_t count = 0;
+  uint32_t stallUs = 0; //longest iteration
+  uint8_t stallSection = SEC_S21;
+  //iteration being timed
+  uint32_t mark = 0, start = 0, longestUs = 0;
+  uint8_t longest = SEC_S21;
+} loopStats;
+//poll cycles per hour of each port, from one minute windows
+uint32_t updatesTotal[S21_MAX_PORTS], updatesRate[S21_MAX_PORTS];
+
+//opens an iteration of loop, the time between iterations is the system's
+void loopStart() {
+  loopStats.start = loopStats.mark = micros();
+  loopStats.longestUs = 0;
+}
+//closes a section of loop
+void loopMark(uint8_t section) {
+  uint32_t now = micros(), us = now - loopStats.mark;
+  loopStats.sectionUs[section] += us;
+  if ( us > loopStats.longestUs ){
+    loopStats.longestUs = us;
+    loopStats.longest = section;
+  }
+  loopStats.mark = now;
+}
+//closes an iteration of loop
+void loopEnd() {
+  uint32_t us = loopStats.mark - loopStats.start;
+  uint8_t bucket = 0;
+  while ( bucket < LOOP_BUCKETS - 1 && us > loopEdges[bucket] ){
+    bucket++;
+  }
+  loopStats.hist[bucket]++;
+  loopStats.totalUs += us;
+  loopStats.count++;
+  if ( us > loopStats.stallUs ){
+    loopStats.stallUs = us;
+    loopStats.stallSection = loopStats.longest;
+  }
+}
+
+//loop, s21 and heap metrics in Prometheus text format
+void sendMetrics(AsyncWebServerRequest *request) {
+  AsyncResponseStream *response = request->beginResponseStream("text/plain; version=0.0.4");
+  auto metric = [&](const char *name, const char *type, const char *help){
+    response->printf("# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+  };
+  metric("daikin_uptime_seconds", "counter", "Time since boot.");
+  response->printf("daikin_uptime_seconds %lu\n", millis() / 1000);
+  metric("daikin_loop_duration_seconds", "histogram", "Duration of loop() iterations.");
+  uint32_t count = 0;
+  for (uint8_t i = 0; i < LOOP_BUCKETS - 1; i++) {
+    count += loopStats.hist[i];
+    response->printf("daikin_loop_duration_seconds_bucket{le=\"%g\"} %u\n", loopEdges[i] / 1e6, count);
+  }
+  response->printf("daikin_loop_duration_seconds_bucket{le=\"+Inf\"} %u\n", loopStats.count);
+  response->printf("daikin_loop_duration_seconds_sum %.6f\ndaikin_loop_duration_seconds_count %u\n", loopStats.totalUs / 1e6, loopStats.count);
+  metric("daikin_loop_section_seconds_total", "counter", "Time spent in each subsystem of loop().");
+  for (uint8_t i = 0; i < SEC_COUNT; i++) {
+    response->printf("daikin_loop_section_seconds_total{section=\"%s\"} %.6f\n", loopSectionNames[i], loopStats.sectionUs[i] / 1e6);
+  }
+  metric("daikin_loop_stall_seconds", "gauge", "Longest loop() iteration since boot, by the subsystem that took most of it.");
+  response->printf("daikin_loop_stall_seconds{section=\"%s\"} %.6f\n", loopSectionNames[loopStats.stallSection], loopStats.stallUs / 1e6);
+  metric("daikin_loop_rate", "gauge", "loop() iterations per second, over the last minute.");
+  response->printf("daikin_loop_rate %u\n", loopRate);
+  metric("daikin_s21_poll_cycles_total", "counter", "S21 poll cycles completed.");
+  for (uint8_t i = 0; i < s21PortsCount; i++) {
+    response->printf("daikin_s21_poll_cycles_total{port=\"%u\"} %u\n", i, s21Ports[i]->updates);
+  }
+  metric("daikin_s21_poll_cycles_per_hour", "gauge", "S21 poll cycles per hour, over the last minute.");
+  for (uint8_t i = 0; i < s21PortsCount; i++) {
+    response->printf("daikin_s21_poll_cycles_per_hour{port=\"%u\"} %u\n", i, updatesRate[i]);
+  }
+  metric("daikin_s21_frames_total", "counter", "S21 frames received.");
+  for (uint8_t i = 0; i < s21PortsCount; i++) {
+    response->printf("daikin_s21_frames_total{port=\"%u\"} %u\n", i, s21Ports[i]->rxStats.frames);
+  }
+  metric("daikin_s21_bad_frames_total", "counter", "S21 frames received with errors.");
+  for (uint8_t i = 0; i < s21PortsCount; i++) {
+    response->printf("daikin_s21_bad_frames_total{port=\"%u\"} %u\n", i, s21Ports[i]->rxStats.badFrames);
+  }
+  metric("daikin_s21_parse_latency_seconds", "gauge", "S21 frame end (ETX) to parsed, last and max since boot. Receive runs from loop(), or right after it, so this follows loop timing.");
+  for (uint8_t i = 0; i < s21PortsCount; i++) {
+    response->printf("daikin_s21_parse_latency_seconds{port=\"%u\",stat=\"last\"} %.6f\n", i, s21Ports[i]->rxStats.lastLatency / 1e6);
+    response->printf("daikin_s21_parse_latency_seconds{port=\"%u\",stat=\"max\"} %.6f\n", i, s21Ports[i]->rxStats.maxLatency / 1e6);
+  }
+  metric("daikin_s21_bus_duty_ratio", "gauge", "S21 bus duty cycle, over the last minute.");
+  for (uint8_t i = 0; i < s21PortsCount; i++) {
+    response->printf("daikin_s21_bus_duty_ratio{port=\"%u\"} %.3f\n", i, s21Ports[i]->busDuty / 1000.0);
+  }
+  metric("daikin_commands_total", "counter", "Inbound commands worked.");
+  response->printf("daikin_commands_total %u\n", cmdCount);
+  metric("daikin_command_seconds_total", "counter", "Time spent parsing and dispatching inbound commands.");
+  response->printf("daikin_command_seconds_total %.6f\n", cmdUs / 1e6);
+  metric("daikin_command_allocations_total", "counter", "Heap allocations while parsing and dispatching inbound commands.");
+  response->printf("daikin_command_allocations_total %u\n", cmdAllocs);
+  uint32_t free, maxBlock;
+  uint8_t fragmentation;
+  ESP.getHeapStats(&free, &maxBlock, &fragmentation);
+  metric("daikin_heap_free_bytes", "gauge", "Free heap.");
+  response->printf("daikin_heap_free_bytes %u\n", free);
+  metric("daikin_heap_max_free_block_bytes", "gauge", "Largest free heap block.");
+  response->printf("daikin_heap_max_free_block_bytes %u\n", maxBlock);
+  metric("daikin_heap_fragmentation_ratio", "gauge", "Heap fragmentation.");
+  response->printf("daikin_heap_fragmentation_ratio %.2f\n", fragmentation / 100.0);
+  request->send(response);
+}
+
 
 //vars declaration
-long lastRead, startTimeMsg, lastRssiSend = -30 * 1000L;
+long startTimeMsg, lastRssiSend = -30 * 1000L;
+uint32_t lastFilterFlush = 0;
 char json[512]; //used for the json message to be sent
-char wsTxt[256]; //holds ws commands from clients
 
+//commands from clients: one single-producer/single-consumer ring per source, consumed round-robin in loop
+//producers only move head, consumer only moves tail, so async callbacks never race the parser
+enum cmdSource : uint8_t { SRC_WS, SRC_HTTP, SRC_MQTT, SRC_COUNT };
+const char* cmdSourceNames[SRC_COUNT] = {"WS", "HTTP", "MQTT"};
+#define CMD_QUEUE_SLOTS 4
+#define CMD_MAX_LEN 256
+struct cmdQueue {
+  char msg[CMD_QUEUE_SLOTS][CMD_MAX_LEN];
+  uint8_t port[CMD_QUEUE_SLOTS]; //default port of each command, the one it came for (MQTT topic). "port" in the message wins
+  uint32_t client[CMD_QUEUE_SLOTS]; //WS client that sent each command, 0 if none
+  volatile uint8_t head = 0, tail = 0;
+  uint32_t received = 0, overflows = 0, tooLong = 0;
+} cmdQueues[SRC_COUNT];
+uint8_t cmdNextSource = 0; //round-robin index, for fairness between sources
+
+//returns the free slot to write a command into, or nullptr if the queue is full
+char* cmdReserve(uint8_t source, uint8_t port = 0, uint32_t client = 0) {
+  cmdQueue &q = cmdQueues[source];
+  if ( (uint8_t)(q.head - q.tail) >= CMD_QUEUE_SLOTS ){
+    q.overflows++;
+    return nullptr;
+  }
+  q.port[q.head % CMD_QUEUE_SLOTS] = port;
+  q.client[q.head % CMD_QUEUE_SLOTS] = client;
+  return q.msg[q.head % CMD_QUEUE_SLOTS];
+}
+//publishes the reserved slot to the consumer
+void cmdCommit(uint8_t source) {
+  cmdQueue &q = cmdQueues[source];
+  q.received++;
+  __sync_synchronize(); //message must be written before moving head
+  q.head++;
+}
+bool cmdEnqueue(uint8_t source, const char *data, size_t len, uint8_t port = 0, uint32_t client = 0) {
+  //trailing terminators are accepted
+  while ( len > 0 && data[len - 1] == '\0' ){
+    len--;
+  }
+  if ( len >= CMD_MAX_LEN ){
+    cmdQueues[source].tooLong++;
+    return false;
+  }
+  char *slot = cmdReserve(source, port, client);
+  if ( !slot ){
+    return false;
+  }
+  memcpy(slot, data, len);
+  slot[len] = '\0';
+  cmdCommit(source);
+  return true;
+}
+//returns the next command to work, round-robin between sources, or nullptr if none. The slot is the consumer's
+//until cmdPop, it can be written (and it's parsed in place)
+char* cmdPeek(uint8_t &source, uint8_t &port, uint32_t &client) {
+  for (uint8_t i = 0; i < SRC_COUNT; i++) {
+    source = (cmdNextSource + i) % SRC_COUNT;
+    cmdQueue &q = cmdQueues[source];
+    if ( q.head != q.tail ){
+      __sync_synchronize(); //head must be read before the message
+      port = q.port[q.tail % CMD_QUEUE_SLOTS];
+      client = q.client[q.tail % CMD_QUEUE_SLOTS];
+      return q.msg[q.tail % CMD_QUEUE_SLOTS];
+    }
+  }
+  return nullptr;
+}
+void cmdPop(uint8_t source) {
+  cmdQueues[source].tail++;
+  cmdNextSource = (source + 1) % SRC_COUNT;
+}
+
+//telemetry filters, one per sink and port. State fields go through right away, other fields when they moved by their
+//dead-band from what was last published, and not before the min interval. After the max interval whatever changed is sent anyway
+enum sink : uint8_t { SINK_WS, SINK_MQTT, SINK_COUNT };
+constexpr uint32_t stateFields = (1UL << AC_POWER) | (1UL << AC_MODE) | (1UL << AC_FAN) | (1UL << AC_SETPOINT) |
+  (1UL << AC_SWING_V) | (1UL << AC_SWING_H) | (1UL << AC_IDLE);
+struct {
+  int32_t published[AC_FIELDS_COUNT]; //last value sent
+  uint32_t pending = 0; //fields past their dead-band, waiting for the min interval
+  uint32_t drifted = 0; //fields changed within their dead-band
+  uint32_t lastSend = 0; //last telemetry sent, ms
+} sinkFilters[SINK_COUNT][S21_MAX_PORTS];
+
+//takes the changed fields of a port, returns the ones to send now to the sink, as sent
+uint32_t filterFields(uint8_t sink, S21Port &port, uint32_t changed) {
+  auto &f = sinkFilters[sink][port.id];
+  uint16_t minInterval = sink == SINK_WS ? config.wsMinInterval : config.mqttMinInterval;
+  uint16_t maxInterval = sink == SINK_WS ? config.wsMaxInterval : config.mqttMaxInterval;
+  for (uint8_t i = 0; i < AC_FIELDS_COUNT; i++) {
+    if ( !(changed & (1UL << i)) ){
+      continue;
+    }
+    int32_t delta = getField(port.acValues, i) - f.published[i];
+    if ( (stateFields & (1UL << i)) || abs(delta) >= max(config.deadBand[i], (uint16_t)1) ){
+      f.pending |= 1UL << i;
+    } else if ( delta != 0 ){
+      f.drifted |= 1UL << i;
+    } else {
+      //back to what was published
+      f.pending &= ~(1UL << i);
+      f.drifted &= ~(1UL << i);
+    }
+  }
+  uint32_t send = f.pending & stateFields;
+  if ( millis() - f.lastSend >= minInterval * 1000UL ){
+    send |= f.pending;
+  }
+  if ( maxInterval > 0 && millis() - f.lastSend >= maxInterval * 1000UL ){
+    send |= f.pending | f.drifted;
+  }
+  if ( send & ~stateFields ){
+    f.lastSend = millis();
+  }
+  for (uint8_t i = 0; i < AC_FIELDS_COUNT; i++) {
+    if ( send & (1UL << i) ){
+      f.published[i] = getField(port.acValues, i);
+    }
+  }
+  f.pending &= ~send;
+  f.drifted &= ~send;
+  return send;
+}
+
+//websocket clients and the format each one speaks. JSON text by default, MessagePack binary after the client
+//sent a MessagePack frame: from then on commands and messages both use it
+#define WS_MAX_CLIENTS 8
+enum wsFormat : uint8_t {WS_JSON, WS_MSGPACK, WS_FORMATS};
+struct wsClientEntry {
+  uint32_t id = 0; //0 for a free entry, ws ids start from 1
+  wsFormat format = WS_JSON;
+} wsClients[WS_MAX_CLIENTS];
+uint8_t wsFormatClients[WS_FORMATS]; //connected clients speaking each format
+
+//message buffers are ours, and freed here once every client is done with them.
+//ws frees the ones from makeBuffer only on textAll, that never comes when every client speaks MessagePack
+#define WS_MAX_BUFFERS 16
+AsyncWebSocketMessageBuffer *wsBuffers[WS_MAX_BUFFERS];
+
+//holds and releases a buffer. The buffer's own count is used, not its lock: the lock is a single bool, and textAll
+//sets and clears it on the buffers it sends, so it can't tell who else still needs them
+void wsHold(AsyncWebSocketMessageBuffer *buffer) {
+  (*buffer)++;
+}
+void wsRelease(AsyncWebSocketMessageBuffer *buffer) {
+  (*buffer)--;
+}
+
+//returns a held buffer for len bytes (+1), to release when sent. nullptr if out of memory or buffers
+AsyncWebSocketMessageBuffer* wsBuffer(size_t len) {
+  int8_t slot = -1;
+  for (uint8_t i = 0; i < WS_MAX_BUFFERS; i++) {
+    if ( wsBuffers[i] && wsBuffers[i]->canDelete() ){
+      delete wsBuffers[i];
+      wsBuffers[i] = nullptr;
+    }
+    if ( !wsBuffers[i] && slot < 0 ){
+      slot = i;
+    }
+  }
+  if ( slot < 0 ){
+    debugE("No free WS buffers, message dropped");
+    return nullptr;
+  }
+  AsyncWebSocketMessageBuffer *buffer = new AsyncWebSocketMessageBuffer(len);
+  if ( !buffer->get() ){
+    delete buffer;
+    return nullptr;
+  }
+  wsHold(buffer);
+  wsBuffers[slot] = buffer;
+  return buffer;
+}
+//returns the entry of a client, nullptr if not tracked
+wsClientEntry* wsClient(uint32_t id) {
+  for (wsClientEntry &c : wsClients) {
+    if ( c.id == id ){
+      return &c;
+    }
+  }
+  return nullptr;
+}
+wsFormat wsClientFormat(AsyncWebSocketClient *client) {
+  wsClientEntry *c = wsClient(client->id());
+  return c ? c->format : WS_JSON;
+}
+void wsSetFormat(AsyncWebSocketClient *client, wsFormat format) {
+  wsClientEntry *c = wsClient(client->id());
+  if ( c && c->format != format ){
+    wsFormatClients[c->format]--;
+    wsFormatClients[format]++;
+    c->format = format;
+  }
+}
+//true if a message in a format is needed: by the client, or by any client when client is null
+bool wsNeeds(AsyncWebSocketClient *client, wsFormat format) {
+  return client ? wsClientFormat(client) == format : wsFormatClients[format] > 0;
+}
+//serializes a message in a format, into a held buffer
+AsyncWebSocketMessageBuffer* wsSerialize(const JsonDocument &root, wsFormat format) {
+  size_t len = format == WS_MSGPACK ? measureMsgPack(root) : measureJson(root);
+  AsyncWebSocketMessageBuffer *buffer = wsBuffer(len);
+  if ( buffer ){
+    if ( format == WS_MSGPACK ){
+      serializeMsgPack(root, (char *)buffer->get(), len);
+    } else {
+      serializeJson(root, (char *)buffer->get(), len + 1);
+    }
+  }
+  return buffer;
+}
+//sends a message to a client, in its format
+void wsSendTo(AsyncWebSocketClient *client, AsyncWebSocketMessageBuffer *const buffers[WS_FORMATS]) {
+  wsFormat format = wsClientFormat(client);
+  if ( !buffers[format] ){
+    return;
+  }
+  if ( format == WS_MSGPACK ){
+    client->binary(buffers[format]);
+  } else {
+    client->text(buffers[format]);
+  }
+}
+//sends a message, one buffer per format, to a client or to every client when client is null
+void wsSendBuffers(AsyncWebSocketClient *client, AsyncWebSocketMessageBuffer *const buffers[WS_FORMATS]) {
+  if ( client ){
+    wsSendTo(client, buffers);
+  } else if ( wsFormatClients[WS_MSGPACK] == 0 ){
+    //everyone speaks JSON. textAll locks and unlocks the buffer, our hold is the count so it's left alone
+    if ( buffers[WS_JSON] ){
+      ws.textAll(buffers[WS_JSON]);
+    }
+  } else {
+    for (wsClientEntry &c : wsClients) {
+      AsyncWebSocketClient *to = c.id ? ws.client(c.id) : nullptr;
+      if ( to ){
+        wsSendTo(to, buffers);
+      }
+    }
+  }
+}
+//sends a message to a client, or to every client when client is null, serialized once in each format in use
+void wsSend(AsyncWebSocketClient *client, const JsonDocument &root) {
+  AsyncWebSocketMessageBuffer *buffers[WS_FORMATS] = {};
+  for (uint8_t f = 0; f < WS_FORMATS; f++) {
+    if ( wsNeeds(client, (wsFormat)f) ){
+      buffers[f] = wsSerialize(root, (wsFormat)f);
+    }
+  }
+  wsSendBuffers(client, buffers);
+  for (AsyncWebSocketMessageBuffer *buffer : buffers) {
+    if ( buffer ){
+      wsRelease(buffer);
+    }
+  }
+}
+
+//server-sent events on /events, read only: the sensor, rssi and config messages of the WS, as events of that type.
+//No deltas, bus stats or commands, so a stream costs less than a WS client. Event ids grow with every event, and the
+//id of the latest event of each kind is kept: a client resuming with Last-Event-ID gets again only the kinds it missed
+#define EVENTS_MAX_CLIENTS 4
+enum eventKind : uint8_t {EVENT_CONFIG, EVENT_RSSI, EVENT_SENSOR}; //sensor events are EVENT_SENSOR + port
+#define EVENT_KINDS (EVENT_SENSOR + S21_MAX_PORTS)
+uint32_t eventsId = 0, eventsKindIds[EVENT_KINDS];
+
+//sends an event to a stream, or to every stream when client is null
+void eventsSend(AsyncEventSourceClient *client, uint8_t kind, const char *type, const char *data) {
+  eventsKindIds[kind] = ++eventsId;
+  if ( client ){
+    client->send(data, type, eventsId);
+  } else {
+    events.send(data, type, eventsId);
+  }
+}
+void eventsSendMsg(AsyncEventSourceClient *client, uint8_t kind, const JsonDocument &root) {
+  AsyncWebSocketMessageBuffer *buffer = wsSerialize(root, WS_JSON);
+  if ( buffer ){
+    eventsSend(client, kind, root["type"].as<const char*>(), (const char *)buffer->get());
+    wsRelease(buffer);
+  }
+}
+
+//config message: 18 members and the dead bands, plus copies of the config strings at their longest
+const size_t configMsgSize = JSON_OBJECT_SIZE(18) + JSON_OBJECT_SIZE(AC_FIELDS_COUNT)
+  + sizeof(config.hostname) + sizeof(config.httpUser) + sizeof(config.mqttUser) + sizeof(config.mqttBroker)
+  + sizeof(config.mqttTestamentTopic) + sizeof(config.mqttSubTopic) + sizeof(config.mqttPubTopic);
 //websocket management function
-void sendConfigWs(AsyncWebSocketClient * client){
-  debugD("Sending config to client");
-  //this sends the game config to clients
-  DynamicJsonDocument root(512);
+void configMsg(JsonDocument &root){
   root["type"] = "config";
   root["period"] = config.period;
   root["hostname"] = config.hostname;
@@ -235,18 +709,30 @@ void sendConfigWs(AsyncWebSocketClient * client){
   root["mqttTestamentTopic"] = config.mqttTestamentTopic;
   root["mqttSubTopic"] = config.mqttSubTopic;
   root["mqttPubTopic"] = config.mqttPubTopic;
-  root["resetNeeded"] = resetNeeded;
-
-  size_t len = measureJson(root);
-  AsyncWebSocketMessageBuffer * buffer = ws.makeBuffer(len); //  creates a buffer (len + 1) for you.
-  if (buffer) {
-    serializeJson(root, (char *)buffer->get(), len + 1);
-    if (client) {
-      client->text(buffer);
-    } else {
-      ws.textAll(buffer);
+  JsonObject deadBands = root.createNestedObject("deadBands");
+  for (uint8_t i = 0; i < AC_FIELDS_COUNT; i++) {
+    if ( !(stateFields & (1UL << i)) ){
+      deadBands[acFields[i].name] = config.deadBand[i];
     }
   }
+  root["wsMinInterval"] = config.wsMinInterval;
+  root["wsMaxInterval"] = config.wsMaxInterval;
+  root["mqttMinInterval"] = config.mqttMinInterval;
+  root["mqttMaxInterval"] = config.mqttMaxInterval;
+  root["resetNeeded"] = resetNeeded;
+  if ( root.overflowed() ){
+    debugE("Config message doesn't fit in %u bytes", root.capacity());
+  }
+}
+void sendConfigWs(AsyncWebSocketClient * client){
+  debugD("Sending config to client");
+  //this sends the game config to clients
+  DynamicJsonDocument root(configMsgSize);
+  configMsg(root);
+  wsSend(client, root);
+  if ( !client && events.count() > 0 ){
+    eventsSendMsg(nullptr, EVENT_CONFIG, root);
+  }
 }
 void sendInfoWs(AsyncWebSocketClient * client){
   debugD("Sending info to client");
@@ -262,252 +748,978 @@ void sendInfoWs(AsyncWebSocketClient * client){
   root["lastRst"] = ESP.getResetReason();
   root["wifiNetwork"] = WiFi.SSID();
 
-  size_t len = measureJson(root);
-  AsyncWebSocketMessageBuffer * buffer = ws.makeBuffer(len); //  creates a buffer (len + 1) for you.
-  if (buffer) {
-    serializeJson(root, (char *)buffer->get(), len + 1);
-    if (client) {
-      client->text(buffer);
+  wsSend(client, root);
+}
+//sensor snapshot of each port and format: values are serialized once per change, into a WS message buffer held while current.
+//WS clients, MQTT and /state all send that same buffer, no copies. MessagePack is serialized only if a client speaks it
+struct {
+  AsyncWebSocketMessageBuffer *buffer = nullptr;
+  uint32_t version = 0, seq = 0; //valuesVersion of the port and delta sequence number when serialized
+} sensorSnapshots[S21_MAX_PORTS][WS_FORMATS];
+//sequence number of the last delta sent for each port. Clients apply deltas in order on top of a snapshot, and ask for a resync on gaps
+uint32_t sensorSeq[S21_MAX_PORTS];
+
+//returns the snapshot of a port, serializing it again if values changed. nullptr if out of memory
+AsyncWebSocketMessageBuffer* sensorSnapshot(S21Port &port, wsFormat format = WS_JSON) {
+  auto &snapshot = sensorSnapshots[port.id][format];
+  if ( snapshot.buffer && snapshot.version == port.valuesVersion && snapshot.seq == sensorSeq[port.id] ){
+    return snapshot.buffer;
+  }
+  debugD("Serializing sensor data of port %u, format %u", port.id, format);
+  StaticJsonDocument<512> root;
+  root["type"] = "sensor";
+  root["port"] = port.id;
+  root["seq"] = sensorSeq[port.id];
+  for (uint8_t i = 0; i < AC_FIELDS_COUNT; i++) {
+    if ( acFields[i].type == FIELD_BOOL ){
+      root[acFields[i].name] = getField(port.acValues, i) != 0;
     } else {
-      ws.textAll(buffer);
+      root[acFields[i].name] = getField(port.acValues, i);
+    }
+  }
+  AsyncWebSocketMessageBuffer * buffer = wsSerialize(root, format);
+  if ( !buffer ){
+    return nullptr;
+  }
+  //the hold from wsBuffer is the snapshot's. The old one is freed as soon as every client (and /state) is done with it
+  if ( snapshot.buffer ){
+    wsRelease(snapshot.buffer);
+  }
+  snapshot.buffer = buffer;
+  snapshot.version = port.valuesVersion;
+  snapshot.seq = sensorSeq[port.id];
+  return buffer;
+}
+void sendSensorDataWs(AsyncWebSocketClient * client, S21Port &port){
+  //this sends the game status to clients
+  debugD("Sending sensor data of port %u to client", port.id);
+  AsyncWebSocketMessageBuffer *buffers[WS_FORMATS] = {};
+  for (uint8_t f = 0; f < WS_FORMATS; f++) {
+    if ( wsNeeds(client, (wsFormat)f) ){
+      buffers[f] = sensorSnapshot(port, (wsFormat)f);
     }
   }
+  wsSendBuffers(client, buffers);
+}
+//sends only the given fields
+void sendSensorDeltaWs(S21Port &port, uint32_t fields){
+  if ( ws.count() > 0){ //only if we have WS clients
+    debugD("Sending sensor delta of port %u to %d clients", port.id, ws.count());
+    StaticJsonDocument<512> root;
+    root["type"] = "delta";
+    root["port"] = port.id;
+    root["seq"] = sensorSeq[port.id];
+    for (uint8_t i = 0; i < AC_FIELDS_COUNT; i++) {
+      if ( !(fields & (1UL << i)) ){
+        continue;
+      }
+      if ( acFields[i].type == FIELD_BOOL ){
+        root[acFields[i].name] = getField(port.acValues, i) != 0;
+      } else {
+        root[acFields[i].name] = getField(port.acValues, i);
+      }
+    }
+    wsSend(0, root);
+  }
+}
+void sendStartTimeWs(AsyncWebSocketClient * client){
+  //this sends last error message
+  debugD("Sending start time to client");
+  DynamicJsonDocument root(256);
+  root["type"] = "startTime";
+  root["startTime"] = startTimeMsg;
+  wsSend(client, root);
+}
+void sendRssiWs(AsyncWebSocketClient * client){
+  //this just sends the RSSI value to clients
+  if ( ws.count() > 0 || events.count() > 0 ){ //only if we have WS or event stream clients
+    debugD("Sending rssi to %d clients", ws.count() + events.count());
+    DynamicJsonDocument root(256);
+    root["type"] = "rssi";
+    root["value"] = WiFi.RSSI();
+    wsSend(client, root);
+    if ( !client && events.count() > 0 ){
+      eventsSendMsg(nullptr, EVENT_RSSI, root);
+    }
+  }
+}
+//bus stats message: 17 members, the error classes, 7 items per register, the bucket edges and 3 histograms.
+//All strings are constant, so they aren't copied. One document, reused by every port and push
+const size_t busStatsSize = JSON_OBJECT_SIZE(17) + JSON_OBJECT_SIZE(ERR_CLASSES)
+  + JSON_ARRAY_SIZE(acRegistersCount) + acRegistersCount * JSON_ARRAY_SIZE(7)
+  + JSON_ARRAY_SIZE(TIMING_BUCKETS - 1) + 3 * JSON_ARRAY_SIZE(TIMING_BUCKETS);
+DynamicJsonDocument busStatsDoc(busStatsSize);
+void sendBusStatsWs(AsyncWebSocketClient * client, S21Port &port){
+  //this sends s21 bus timings to clients
+  if ( ws.count() > 0){ //only if we have WS clients
+    debugD("Sending bus stats of port %u to %d clients", port.id, ws.count());
+    const acRegTiming *acRegTimings = port.acRegTimings;
+    JsonDocument &root = busStatsDoc;
+    root.clear();
+    root["type"] = "bus";
+    root["port"] = port.id;
+    root["transport"] = port.serial.name();
+    root["duty"] = port.busDuty / 10.0;
+    root["lineErrors"] = port.serial.errors();
+    root["badFrames"] = port.rxStats.badFrames;
+    root["frames"] = port.rxStats.frames;
+    root["loopRate"] = loopRate;
+    root["frameRate"] = frameRate;
+    root["gap"] = port.frameGap;
+    root["cmdAckTimeout"] = timingTimeout(port.cmdAckTiming);
+    JsonObject errors = root.createNestedObject("errors");
+    for (uint8_t e = 0; e < ERR_CLASSES; e++) {
+      errors[s21ErrorNames[e]] = port.errorCount((s21Error)e);
+    }
+    //registers: query, ACK timeout, frame timeout, queries, errors, retries, demoted
+    JsonArray regs = root.createNestedArray("regs");
+    //histograms are summed over all registers
+    uint32_t ack[TIMING_BUCKETS] = {}, firstByte[TIMING_BUCKETS] = {}, frame[TIMING_BUCKETS] = {};
+    for (uint8_t i = 0; i < acRegistersCount; i++) {
+      JsonArray reg = regs.createNestedArray();
+      reg.add(acRegisters[i].query);
+      reg.add(timingTimeout(acRegTimings[i].ack));
+      reg.add(timingTimeout(acRegTimings[i].firstByte));
+      const acRegHealth &h = port.acRegHealths[i];
+      reg.add(h.queries);
+      reg.add(h.errors[ERR_TIMEOUT] + h.errors[ERR_NAK] + h.errors[ERR_UNEXPECTED] + h.errors[ERR_CHECKSUM]);
+      reg.add(h.retries);
+      reg.add((port.acRegDemoted >> i) & 1);
+      for (uint8_t b = 0; b < TIMING_BUCKETS; b++) {
+        ack[b] += acRegTimings[i].ack.hist[b];
+        firstByte[b] += acRegTimings[i].firstByte.hist[b];
+        frame[b] += acRegTimings[i].frame.hist[b];
+      }
+    }
+    JsonArray edges = root.createNestedArray("edges");
+    JsonArray ackHist = root.createNestedArray("ack");
+    JsonArray firstByteHist = root.createNestedArray("firstByte");
+    JsonArray frameHist = root.createNestedArray("frame");
+    for (uint8_t b = 0; b < TIMING_BUCKETS; b++) {
+      if ( b < TIMING_BUCKETS - 1 ){
+        edges.add(timingEdges[b]);
+      }
+      ackHist.add(ack[b]);
+      firstByteHist.add(firstByte[b]);
+      frameHist.add(frame[b]);
+    }
+    if ( root.overflowed() ){
+      debugE("Bus stats of port %u don't fit in %u bytes", port.id, busStatsSize);
+    }
+    wsSend(client, root);
+  }
+}
+//sensor event of a port, from the snapshot
+void eventsSendSensor(AsyncEventSourceClient *client, S21Port &port){
+  AsyncWebSocketMessageBuffer *buffer = sensorSnapshot(port);
+  if ( buffer ){
+    eventsSend(client, EVENT_SENSOR + port.id, "sensor", (const char *)buffer->get());
+  }
+}
+//new event stream: everything, or only the kinds missed since Last-Event-ID
+void onEventsConnect(AsyncEventSourceClient *client){
+  if ( events.count() > EVENTS_MAX_CLIENTS ){
+    debugE("Too many event streams, closing the new one");
+    client->close();
+    return;
+  }
+  uint32_t lastId = client->lastId();
+  if ( lastId > eventsId ){
+    //from before a reboot
+    lastId = 0;
+  }
+  debugD("Event stream connected, last id %u", lastId);
+  bool missed[EVENT_KINDS];
+  for (uint8_t k = 0; k < EVENT_KINDS; k++) {
+    missed[k] = lastId == 0 || eventsKindIds[k] > lastId;
+  }
+  if ( missed[EVENT_CONFIG] ){
+    DynamicJsonDocument root(configMsgSize);
+    configMsg(root);
+    eventsSendMsg(client, EVENT_CONFIG, root);
+  }
+  if ( missed[EVENT_RSSI] ){
+    DynamicJsonDocument root(256);
+    root["type"] = "rssi";
+    root["value"] = WiFi.RSSI();
+    eventsSendMsg(client, EVENT_RSSI, root);
+  }
+  for (uint8_t i = 0; i < s21PortsCount; i++) {
+    if ( missed[EVENT_SENSOR + i] ){
+      eventsSendSensor(client, *s21Ports[i]);
+    }
+  }
+}
+
+//config and status, to a new client
+void sendAllWs(AsyncWebSocketClient * client){
+  sendConfigWs(client);
+  for (uint8_t i = 0; i < s21PortsCount; i++) {
+    sendSensorDataWs(client, *s21Ports[i]);
+  }
+  sendInfoWs(client);
+  sendStartTimeWs(client);
+  sendRssiWs(client);
+  for (uint8_t i = 0; i < s21PortsCount; i++) {
+    sendBusStatsWs(client, *s21Ports[i]);
+  }
+}
+//base WS function
+void onWsEvent(AsyncWebSocket * server, AsyncWebSocketClient * client, AwsEventType type, void * arg, uint8_t *data, size_t len){
+  if(type == WS_EVT_CONNECT){
+    //new client, JSON until it speaks MessagePack
+    debugD("Websocket client connection received");
+    wsClientEntry *entry = wsClient(0);
+    if ( !entry ){
+      debugE("Too many WS clients, closing the new one");
+      client->close();
+      return;
+    }
+    entry->id = client->id();
+    entry->format = WS_JSON;
+    wsFormatClients[WS_JSON]++;
+    sendAllWs(client);
+  } else if(type == WS_EVT_DISCONNECT){
+    debugD("Client disconnected");
+    wsClientEntry *entry = wsClient(client->id());
+    if ( entry ){
+      wsFormatClients[entry->format]--;
+      entry->id = 0;
+    }
+  } else if(type == WS_EVT_DATA){
+    //data packet received
+    AwsFrameInfo * info = (AwsFrameInfo*)arg;
+    if(info->opcode == WS_TEXT && info->final && info->index == 0 && info->len == len){
+      //queue message for loop
+      if ( !cmdEnqueue(SRC_WS, (char*)data, len, 0, client->id()) ){
+        debugE("WS command dropped, queue full or message too long");
+      }
+    } else if(info->opcode == WS_BINARY && info->final && info->index == 0 && info->len == len){
+      //MessagePack: the client speaks it from now on. Commands are queued as JSON, like the HTTP ones
+      StaticJsonDocument<256> cmd;
+      auto error = deserializeMsgPack(cmd, (const char*)data, len);
+      if (error) {
+        debugE("deserializeMsgPack() failed with code %s", error.c_str());
+        return;
+      }
+      if ( wsClientFormat(client) != WS_MSGPACK ){
+        debugD("WS client %u switched to MessagePack", client->id());
+        wsSetFormat(client, WS_MSGPACK);
+      }
+      if ( strcmp(cmd["command"] | "", "hello") == 0 ){
+        //everything again, in the new format
+        sendAllWs(client);
+        return;
+      }
+      char *slot = measureJson(cmd) < CMD_MAX_LEN ? cmdReserve(SRC_WS, 0, client->id()) : nullptr;
+      if ( !slot ){
+        debugE("WS command dropped, queue full or message too long");
+        return;
+      }
+      serializeJson(cmd, slot, CMD_MAX_LEN);
+      cmdCommit(SRC_WS);
+    } else {
+      debugE("Something's wrong in received frame");
+    }
+  }
+}
+
+//If-None-Match: "*" or a comma separated list of tags. Compared weakly, W/ prefixes don't count (RFC 7232)
+bool etagMatches(AsyncWebServerRequest *request, const char *etag) {
+  if ( !request->hasHeader("If-None-Match") ){
+    return false;
+  }
+  const String &header = request->getHeader("If-None-Match")->value();
+  if ( strncmp(etag, "W/", 2) == 0 ){
+    etag += 2;
+  }
+  size_t etagLen = strlen(etag);
+  const char *p = header.c_str();
+  while ( *p ){
+    while ( *p == ' ' || *p == '\t' || *p == ',' ){
+      p++;
+    }
+    if ( *p == '*' ){
+      return true;
+    }
+    if ( strncmp(p, "W/", 2) == 0 ){
+      p += 2;
+    }
+    const char *tag = p;
+    if ( *p == '"' ){
+      //quoted, commas inside don't split
+      const char *close = strchr(p + 1, '"');
+      p = close ? close + 1 : p + strlen(p);
+    } else {
+      while ( *p && *p != ',' ){
+        p++;
+      }
+    }
+    if ( (size_t)(p - tag) == etagLen && strncmp(tag, etag, etagLen) == 0 ){
+      return true;
+    }
+    while ( *p && *p != ',' ){
+      p++;
+    }
+  }
+  return false;
+}
+
+//http /state: the sensor snapshot, with a weak ETag made of a per boot salt and the values version. Not the start time,
+//it's 0 until time is synced, and the version starts over at every boot: tags would repeat across reboots.
+//The snapshot also carries seq, that's why it's weak: values are the same, not the bytes
+uint32_t etagSalt = 0;
+void sendState(AsyncWebServerRequest *request, S21Port &port, bool notModified) {
+  char etag[32];
+  snprintf(etag, sizeof(etag), "W/\"%08lx-%lx\"", (unsigned long)etagSalt, (unsigned long)port.valuesVersion);
+  if ( !notModified ){
+    notModified = etagMatches(request, etag);
+  }
+  AsyncWebServerResponse *response;
+  if ( notModified ){
+    response = request->beginResponse(304);
+  } else {
+    AsyncWebSocketMessageBuffer *buffer = sensorSnapshot(port);
+    if ( !buffer ){
+      request->send(503, "application/json", "{\"error\":\"out of memory\"}");
+      return;
+    }
+    //sent straight from the snapshot, held until the request is over. A count of its own, so the snapshot moving on
+    //and the request ending don't release each other's hold
+    wsHold(buffer);
+    request->onDisconnect([buffer](){ wsRelease(buffer); });
+    response = request->beginResponse_P(200, "application/json", buffer->get(), buffer->length());
+  }
+  response->addHeader("ETag", etag);
+  response->addHeader("X-State-Version", String(port.valuesVersion));
+  response->addHeader("Cache-Control", "no-cache");
+  request->send(response);
+}
+
+//long-polls on /state (?since=<version>&wait=<s>): requests held until the values of the port move on from since,
+//then answered with the new state, or with a 304 when the wait is over
+#define STATE_MAX_WAITING 4
+#define STATE_MAX_WAIT 60 //s
+struct {
+  AsyncWebServerRequest *request = nullptr;
+  uint8_t port = 0;
+  uint32_t since = 0, start = 0, wait = 0; //wait in ms
+} stateWaiting[STATE_MAX_WAITING];
+
+//holds a request, false if too many are held already
+bool stateWait(AsyncWebServerRequest *request, S21Port &port, uint32_t since, uint32_t wait) {
+  for (auto &w : stateWaiting) {
+    if ( !w.request ){
+      w.request = request;
+      w.port = port.id;
+      w.since = since;
+      w.start = millis();
+      w.wait = wait * 1000;
+      //the client can go away while waiting
+      request->onDisconnect([&w, request](){
+        if ( w.request == request ){
+          w.request = nullptr;
+        }
+      });
+      return true;
+    }
+  }
+  return false;
+}
+//answers the held requests whose state changed or whose wait is over
+void stateWaitLoop() {
+  for (auto &w : stateWaiting) {
+    if ( !w.request ){
+      continue;
+    }
+    S21Port &port = *s21Ports[w.port];
+    bool changed = port.valuesVersion != w.since;
+    if ( changed || millis() - w.start >= w.wait ){
+      AsyncWebServerRequest *request = w.request;
+      w.request = nullptr;
+      sendState(request, port, !changed);
+    }
+  }
+}
+
+//web assets: gzipped copies made on uploadfs by scripts/web_assets.py, listed in /assets.txt as "<url> <file> <hash>".
+//<file>.gz is served on <url> with the hash as strong ETag. Urls with the hash in them never change, they are cached
+//for good, the others are revalidated. Plain files are served to clients without gzip, and when there's no list
+const char* assetType(const String &file) {
+  if ( file.endsWith(".html") ) return "text/html";
+  if ( file.endsWith(".js") ) return "text/js";
+  if ( file.endsWith(".ico") ) return "image/x-icon";
+  return "application/octet-stream";
+}
+void sendAsset(AsyncWebServerRequest *request, const String &file, const String &etag, bool immutable) {
+  AsyncWebHeader *encoding = request->getHeader("Accept-Encoding");
+  if ( !encoding || encoding->value().indexOf("gzip") < 0 ){
+    request->send(LittleFS, file, assetType(file));
+    return;
+  }
+  AsyncWebServerResponse *response;
+  if ( etagMatches(request, etag.c_str()) ){
+    response = request->beginResponse(304);
+  } else {
+    response = request->beginResponse(LittleFS, file + ".gz", assetType(file));
+    response->addHeader("Content-Encoding", "gzip");
+  }
+  response->addHeader("ETag", etag);
+  response->addHeader("Cache-Control", immutable ? "public, max-age=31536000, immutable" : "no-cache");
+  response->addHeader("Vary", "Accept-Encoding");
+  request->send(response);
+}
+//routes for the assets in the list, returns how many
+uint8_t serveAssets() {
+  File list = LittleFS.open("/assets.txt", "r");
+  if ( !list ){
+    return 0;
+  }
+  uint8_t count = 0;
+  while ( list.available() ){
+    String line = list.readStringUntil('\n');
+    int sep1 = line.indexOf(' '), sep2 = line.lastIndexOf(' ');
+    if ( sep1 <= 0 || sep2 <= sep1 ){
+      continue;
+    }
+    String url = line.substring(0, sep1), file = line.substring(sep1 + 1, sep2), hash = line.substring(sep2 + 1);
+    hash.trim();
+    bool immutable = url.indexOf(hash) >= 0;
+    String etag = "\"" + hash + "\"";
+    bool auth = file != "/favicon.ico";
+    server.on(url.c_str(), HTTP_GET, [file, etag, immutable, auth](AsyncWebServerRequest *request){
+      if(auth && config.httpAuthEnable == true && !request->authenticate(config.httpUser, config.httpPass))
+        return request->requestAuthentication();
+      sendAsset(request, file, etag, immutable);
+    }).setFilter(ON_STA_FILTER);
+    debugD("Serving %s on %s, ETag %s", file.c_str(), url.c_str(), etag.c_str());
+    count++;
+  }
+  list.close();
+  return count;
+}
+
+//telemetry history of each port (lib/History): a sample a minute, kept in RAM and appended block by block to
+///history<port>.bin. When that is HISTORY_FILE_BLOCKS long it becomes /history<port>.old, so 3 to 7 days are kept
+#define HISTORY_INTERVAL 60 //s
+#define HISTORY_FILE_BLOCKS 64
+constexpr uint8_t historyFields[HISTORY_VALUES] = {AC_TEMP_INSIDE, AC_TEMP_OUTSIDE, AC_TEMP_COIL, AC_COMPRESSOR_FREQ, AC_FAN_RPM, AC_POWER, AC_MODE};
+struct {
+  historyRing ring;
+  uint32_t stored = 0; //blocks of the ring already in the file
+} histories[S21_MAX_PORTS];
+uint32_t lastHistorySample = 0;
+uint8_t historyExports = 0; //files are left alone while exports are running
+#define HISTORY_MAX_EXPORTS 2
+
+void historyFile(char *buf, size_t size, uint8_t port, bool old) {
+  snprintf(buf, size, "/history%u.%s", port, old ? "old" : "bin");
+}
+//a sample of each port that has values, once time is known
+void historySampleLoop() {
+  if ( millis() - lastHistorySample < HISTORY_INTERVAL * 1000UL ){
+    return;
+  }
+  lastHistorySample = millis();
+  if ( timeStatus() == timeNotSet ){
+    return;
+  }
+  for (uint8_t i = 0; i < s21PortsCount; i++) {
+    S21Port &port = *s21Ports[i];
+    if ( port.valuesVersion == 0 ){
+      continue;
+    }
+    historySample sample;
+    sample.time = UTC.now();
+    for (uint8_t v = 0; v < HISTORY_VALUES; v++) {
+      sample.values[v] = getField(port.acValues, historyFields[v]);
+    }
+    histories[i].ring.add(sample);
+  }
+}
+//sealed blocks to the files, one per call. If the file system is not there they stay in RAM, as long as there's room
+void historyStoreLoop() {
+  if ( historyExports > 0 ){
+    return;
+  }
+  for (uint8_t i = 0; i < s21PortsCount; i++) {
+    auto &h = histories[i];
+    if ( h.stored >= h.ring.current() ){
+      continue;
+    }
+    if ( h.stored < h.ring.oldest() ){
+      debugE("History of port %u: %u blocks lost", i, h.ring.oldest() - h.stored);
+      h.stored = h.ring.oldest();
+    }
+    char name[20];
+    historyFile(name, sizeof(name), i, false);
+    File file = LittleFS.open(name, "a");
+    if ( file && file.size() >= HISTORY_FILE_BLOCKS * HISTORY_BLOCK_SIZE ){
+      //rotating
+      file.close();
+      char old[20];
+      historyFile(old, sizeof(old), i, true);
+      LittleFS.remove(old);
+      LittleFS.rename(name, old);
+      file = LittleFS.open(name, "a");
+    }
+    if ( !file ){
+      return;
+    }
+    file.write((const uint8_t*)h.ring.block(h.stored), HISTORY_BLOCK_SIZE);
+    file.close();
+    h.stored++;
+    return;
+  }
+}
+
+//a /history export, streamed in chunks: the old file, the file, then the blocks still in RAM. One block at a time
+//is read and decoded, one line at a time is formatted
+struct historyExport {
+  uint8_t port = 0;
+  uint32_t from = 0, to = UINT32_MAX;
+  uint8_t fields = 0; //mask of historyFields
+  bool json = false;
+  uint8_t source = 0; //0 old file, 1 file, 2 RAM, 3 end
+  File file;
+  uint32_t next = 0; //next RAM block
+  historyBlock block; //being read, a copy
+  historyBlockReader reader;
+  uint32_t rows = 0;
+  char line[160];
+  uint8_t lineLen = 0, linePos = 0;
+  bool done = false;
+
+  //loads the next block, false at the end
+  bool nextBlock() {
+    while ( source < 2 ){
+      if ( !file ){
+        char name[20];
+        historyFile(name, sizeof(name), port, source == 0);
+        file = LittleFS.open(name, "r");
+      }
+      if ( file && file.read((uint8_t*)&block, sizeof(block)) == sizeof(block) ){
+        reader.start(&block);
+        return true;
+      }
+      file.close();
+      source++;
+    }
+    historyRing &ring = histories[port].ring;
+    if ( source == 2 ){
+      if ( next < ring.oldest() ){
+        next = ring.oldest();
+      }
+      if ( next <= ring.current() ){
+        block = *ring.block(next++);
+        reader.start(&block);
+        return true;
+      }
+      source++;
+    }
+    return false;
+  }
+  //formats the next line, false at the end
+  bool nextLine() {
+    historySample s;
+    lineLen = linePos = 0;
+    for (;;) {
+      if ( !reader.next(s) ){
+        if ( !nextBlock() ){
+          break;
+        }
+        continue;
+      }
+      if ( s.time < from || s.time > to ){
+        continue;
+      }
+      int len = snprintf(line, sizeof(line), json ? (rows ? ",\n[%lu" : "[%lu") : "%lu", (unsigned long)s.time);
+      for (uint8_t v = 0; v < HISTORY_VALUES; v++) {
+        if ( fields & (1 << v) ){
+          len += snprintf(line + len, sizeof(line) - len, ",%ld", (long)s.values[v]);
+        }
+      }
+      len += snprintf(line + len, sizeof(line) - len, json ? "]" : "\n");
+      lineLen = len;
+      rows++;
+      return true;
+    }
+    if ( done ){
+      return false;
+    }
+    done = true;
+    lineLen = snprintf(line, sizeof(line), json ? "]}\n" : "");
+    return lineLen > 0;
+  }
+  size_t fill(uint8_t *buf, size_t maxLen) {
+    size_t len = 0;
+    while ( len < maxLen ){
+      if ( linePos == lineLen && !nextLine() ){
+        break;
+      }
+      size_t n = min(maxLen - len, (size_t)(lineLen - linePos));
+      memcpy(buf + len, line + linePos, n);
+      len += n;
+      linePos += n;
+    }
+    return len;
+  }
+};
+
+//wifimanager callbacks
+void configModeCallback(AsyncWiFiManager *myWiFiManager) {
+  WiFi.persistent(true);
+  logSerial.println("Connection failed. Entering config mode.");
+  logSerial.println(WiFi.softAPIP());
+  logSerial.println(myWiFiManager->getConfigPortalSSID());
+}
+void saveConfigCallback() {
+  logSerial.println("New config saved.");
+  WiFi.persistent(false);
+}
+
+//mqtt functions
+//topic of a port: port 0 uses the configured one, port n uses <topic>/n
+const char* portTopic(char *buf, size_t size, const char *topic, uint8_t port) {
+  if ( port == 0 ){
+    return topic;
+  }
+  snprintf(buf, size, "%s/%u", topic, port);
+  return buf;
+}
+
+//per field topics: <pubTopic>[/port]/<field>, retained plain values, published only when changed.
+//Plain value commands are accepted on <pubTopic>[/port]/<field>/set
+#define MQTT_HVAC_MODE AC_FIELDS_COUNT //one more field, for HA: the mode, or off when power is off
+#define MQTT_FIELDS_COUNT (AC_FIELDS_COUNT + 1)
+uint32_t mqttDirty[S21_MAX_PORTS]; //fields still to publish for each port, all of them after a connection
+const char* mqttFieldName(uint8_t field) {
+  return field == MQTT_HVAC_MODE ? "hvac_mode" : acFields[field].name;
+}
+//climate mode, HA names
+const char* haModeName(uint8_t mode) {
+  switch (mode) {
+    case '0': //it seems it reports 0 when set to auto (1)
+    case '1':
+      return "auto";
+    case '2':
+      return "dry";
+    case '3':
+      return "cool";
+    case '4':
+      return "heat";
+    case '6':
+      return "fan_only";
+    default:
+      return "unknown";
+  }
 }
-void sendSensorDataWs(AsyncWebSocketClient * client){
-  //this sends the game status to clients
-  debugD("Sending sensor data to client");
-  DynamicJsonDocument root(512);
-  root["type"] = "sensor";
-  root["power"] = acValues.power_on;
-  root["mode"] = acValues.mode;
-  root["fan"] = acValues.fan;
-  root["setpoint"] = acValues.setpoint;
-  root["swing_v"] = acValues.swing_v;
-  root["swing_h"] = acValues.swing_h;
-  root["temp_inside"] = acValues.temp_inside;
-  root["temp_outside"] = acValues.temp_outside;
-  root["temp_coil"] = acValues.temp_coil;
-  root["target_fan_rpm"] = acValues.target_fan_rpm;
-  root["fan_rpm"] = acValues.fan_rpm;
-  root["idle"] = acValues.idle;
-  root["compressor_freq"] = acValues.compressor_freq;
-  root["target_angle"] = acValues.target_angle;
-  root["angle"] = acValues.angle;
-
-  size_t len = measureJson(root);
-  AsyncWebSocketMessageBuffer * buffer = ws.makeBuffer(len); //  creates a buffer (len + 1) for you.
-  if (buffer) {
-    serializeJson(root, (char *)buffer->get(), len + 1);
-    if (client) {
-      client->text(buffer);
-    } else {
-      ws.textAll(buffer);
+//climate mode from HA name: 0 is off, UINT8_MAX is unknown
+uint8_t haModeCode(const char *name) {
+  if ( strcmp(name, "off") == 0 ){
+    return 0;
+  }
+  for (uint8_t i = 0; i < sizeof(modes); i++) {
+    if ( modes[i] && strcmp(name, haModeName(modes[i])) == 0 ){
+      return modes[i];
     }
   }
+  return UINT8_MAX;
 }
-void sendStartTimeWs(AsyncWebSocketClient * client){
-  //this sends last error message
-  debugD("Sending start time to client");
-  DynamicJsonDocument root(256);
-  root["type"] = "startTime";
-  root["startTime"] = startTimeMsg;
-  size_t len = measureJson(root);
-  AsyncWebSocketMessageBuffer * buffer = ws.makeBuffer(len); //  creates a buffer (len + 1) for you.
-  if (buffer) {
-    serializeJson(root, (char *)buffer->get(), len + 1);
-    if (client) {
-      client->text(buffer);
-    } else {
-      ws.textAll(buffer);
+//fan speed from its name (as speed_to_string), 0 if unknown
+uint8_t fanCode(const char *name) {
+  for (uint8_t i = 0; i < sizeof(speeds); i++) {
+    if ( strcasecmp(name, speed_to_string(speeds[i])) == 0 ){
+      return speeds[i];
     }
   }
+  return 0;
 }
-void sendRssiWs(AsyncWebSocketClient * client){
-  //this just sends the RSSI value to clients
-  if ( ws.count() > 0){ //only if we have WS clients
-    debugD("Sending rssi to %d clients", ws.count());
-    DynamicJsonDocument root(256);
-    root["type"] = "rssi";
-    root["value"] = WiFi.RSSI();
-    size_t len = measureJson(root);
-    AsyncWebSocketMessageBuffer * buffer = ws.makeBuffer(len); //  creates a buffer (len + 1) for you.
-    if (buffer) {
-      serializeJson(root, (char *)buffer->get(), len + 1);
-      if (client) {
-        client->text(buffer);
-      } else {
-        ws.textAll(buffer);
+//plain value of a field, as published on its topic: temperatures in C, booleans as ON/OFF, modes by name
+const char* mqttFieldValue(char *buf, size_t size, S21Port &port, uint8_t field) {
+  if ( field == MQTT_HVAC_MODE ){
+    return port.acValues.power_on ? haModeName(port.acValues.mode) : "off";
+  }
+  int32_t val = getField(port.acValues, field);
+  switch (field) {
+    case AC_MODE:
+      return haModeName(val);
+    case AC_FAN:
+      return speed_to_string(val);
+    case AC_SETPOINT:
+    case AC_TEMP_INSIDE:
+    case AC_TEMP_OUTSIDE:
+    case AC_TEMP_COIL:
+      snprintf(buf, size, "%.1f", val / 10.0);
+      return buf;
+    default:
+      if ( acFields[field].type == FIELD_BOOL ){
+        return val ? "ON" : "OFF";
       }
-    }
+      snprintf(buf, size, "%ld", (long)val);
+      return buf;
   }
 }
-//base WS function
-void onWsEvent(AsyncWebSocket * server, AsyncWebSocketClient * client, AwsEventType type, void * arg, uint8_t *data, size_t len){
-  if(type == WS_EVT_CONNECT){
-    //new client, sending config and status
-    debugD("Websocket client connection received");
-    sendConfigWs(client);
-    sendSensorDataWs(client);
-    sendInfoWs(client);
-    sendStartTimeWs(client);
-    sendRssiWs(client);
-  } else if(type == WS_EVT_DISCONNECT){
-    debugD("Client disconnected");
- 
-  } else if(type == WS_EVT_DATA){
-    //data packet received
-    AwsFrameInfo * info = (AwsFrameInfo*)arg;
-    if(info->opcode == WS_TEXT && info->final && info->index == 0 && info->len == len){
-      //copy message to char array
-      memcpy(wsTxt, (char*)data, len);
-      //terminate it
-      wsTxt[len] = '\0';
-    } else {
-      debugE("Something's wrong in received frame");
+//publishes the changed fields of a port. What fails is left for the next round
+void mqttPublishFields(S21Port &port) {
+  char buf[72], topic[96], value[16];
+  const char *base = portTopic(buf, sizeof(buf), config.mqttPubTopic, port.id);
+  for (uint8_t i = 0; i < MQTT_FIELDS_COUNT && mqttDirty[port.id]; i++) {
+    if ( !(mqttDirty[port.id] & (1UL << i)) ){
+      continue;
+    }
+    snprintf(topic, sizeof(topic), "%s/%s", base, mqttFieldName(i));
+    if ( !mqttClient.publish(topic, mqttFieldValue(value, sizeof(value), port, i), true) ){
+      return;
     }
+    mqttDirty[port.id] &= ~(1UL << i);
   }
 }
-
-//wifimanager callbacks
-void configModeCallback(AsyncWiFiManager *myWiFiManager) {
-  WiFi.persistent(true);
-  Serial.println("Connection failed. Entering config mode.");
-  Serial.println(WiFi.softAPIP());
-  Serial.println(myWiFiManager->getConfigPortalSSID());
+//rollups of each port (lib/History): fed with every parsed frame, on local time so that days are local days.
+//Closed windows are published, retained, on <pubTopic>[/port]/stats/<minute|hour|day>, and the rollups are saved
+//to /rollup<port>.bin every ROLLUP_SAVE_INTERVAL, so a reboot doesn't lose the hour and the day being filled
+#define ROLLUP_SAVE_INTERVAL 600 //s
+#define ROLLUP_MAGIC 0x524F4C31 //ROL1, changes with struct rollup
+constexpr uint8_t rollupFields[ROLLUP_TEMPS] = {AC_TEMP_INSIDE, AC_TEMP_OUTSIDE, AC_TEMP_COIL};
+rollup rollups[S21_MAX_PORTS];
+//local time at millis() 0, s. Refreshed by loop, the poll path doesn't call ezTime. 0 until time is set
+uint32_t rollupClock = 0;
+uint32_t lastRollupRoll = 0, lastRollupSave = 0;
+
+void rollupFile(char *buf, size_t size, uint8_t port) {
+  snprintf(buf, size, "/rollup%u.bin", port);
 }
-void saveConfigCallback() {
-  Serial.println("New config saved.");
-  WiFi.persistent(false);
+void rollupLoad() {
+  for (uint8_t i = 0; i < s21PortsCount; i++) {
+    char name[20];
+    rollupFile(name, sizeof(name), i);
+    File file = LittleFS.open(name, "r");
+    if ( !file ){
+      continue;
+    }
+    uint32_t magic = 0;
+    if ( file.read((uint8_t*)&magic, sizeof(magic)) != sizeof(magic) || magic != ROLLUP_MAGIC
+      || file.read((uint8_t*)&rollups[i], sizeof(rollup)) != sizeof(rollup) ){
+      debugE("Rollup of port %u not valid, starting over", i);
+      rollups[i] = rollup();
+    }
+    file.close();
+    //what happened while off is not known
+    rollups[i].restart();
+    rollups[i].closed = 0;
+  }
 }
-
-//Daikin AC Functions
-
-//calculates checksum
-uint8_t s21_checksum(uint8_t *bytes, uint8_t len) {
-  uint8_t checksum = 0;
-  for (uint8_t i = 0; i < len; i++) {
-    checksum += bytes[i];
-  }
-  return checksum;
-}
-uint8_t s21_checksum(std::vector<uint8_t> bytes) {
-  return s21_checksum(&bytes[0], bytes.size());
-}
-
-//turns bytes to num
-int16_t bytes_to_num(uint8_t *bytes, size_t len) {
-  // <ones><tens><hundreds><neg/pos>
-  int16_t val = 0;
-  val = bytes[0] - '0';
-  val += (bytes[1] - '0') * 10;
-  val += (bytes[2] - '0') * 100;
-  if (len > 3 && bytes[3] == '-')
-    val *= -1;
-  return val;
-}
-int16_t bytes_to_num(std::vector<uint8_t> &bytes) {
-  return bytes_to_num(&bytes[0], bytes.size());
-}
-
-//turns temp bytes to num
-int16_t temp_bytes_to_c10(uint8_t *bytes) {
-  return bytes_to_num(bytes, 4);
-}
-int16_t temp_bytes_to_c10(std::vector<uint8_t> &bytes) {
-  return temp_bytes_to_c10(&bytes[0]);
-}
-
-//turn temperature num to bytes
-uint8_t c10_to_setpoint_byte(int16_t setpoint) {
-  return (setpoint + 3) / 5 + 28;
-}
-
-//turn bytes to HEX
-std::string hex_repr(uint8_t *bytes, size_t len) {
-  std::string res;
-  char buf[5];
-  for (size_t i = 0; i < len; i++) {
-    if (i > 0)
-      res += ':';
-    sprintf(buf, "%02X", bytes[i]);
-    res += buf;
-  }
-  return res;
-}
-
-//turn bytes to string
-std::string str_repr(uint8_t *bytes, size_t len) {
-  std::string res;
-  char buf[5];
-  for (size_t i = 0; i < len; i++) {
-    if (bytes[i] == 7) {
-      res += "\\a";
-    } else if (bytes[i] == 8) {
-      res += "\\b";
-    } else if (bytes[i] == 9) {
-      res += "\\t";
-    } else if (bytes[i] == 10) {
-      res += "\\n";
-    } else if (bytes[i] == 11) {
-      res += "\\v";
-    } else if (bytes[i] == 12) {
-      res += "\\f";
-    } else if (bytes[i] == 13) {
-      res += "\\r";
-    } else if (bytes[i] == 27) {
-      res += "\\e";
-    } else if (bytes[i] == 34) {
-      res += "\\\"";
-    } else if (bytes[i] == 39) {
-      res += "\\'";
-    } else if (bytes[i] == 92) {
-      res += "\\\\";
-    } else if (bytes[i] < 32 || bytes[i] > 127) {
-      sprintf(buf, "\\x%02X", bytes[i]);
-      res += buf;
+void rollupSave() {
+  for (uint8_t i = 0; i < s21PortsCount; i++) {
+    char name[20];
+    rollupFile(name, sizeof(name), i);
+    File file = LittleFS.open(name, "w");
+    if ( !file ){
+      return;
+    }
+    uint32_t magic = ROLLUP_MAGIC;
+    file.write((const uint8_t*)&magic, sizeof(magic));
+    file.write((const uint8_t*)&rollups[i], sizeof(rollup));
+    file.close();
+  }
+}
+//a closed window as JSON: temperatures in C, compressor on-time in s and in percent of the time with data, load in Hz h
+void rollupPublish(S21Port &port, uint8_t w) {
+  const rollupWindow &win = rollups[port.id].last[w];
+  char buf[72], topic[96], payload[384];
+  snprintf(topic, sizeof(topic), "%s/stats/%s", portTopic(buf, sizeof(buf), config.mqttPubTopic, port.id), rollupNames[w]);
+  //window start is local time: formatted as such, with its offset
+  int len = snprintf(payload, sizeof(payload), "{\"start\":\"%s\",\"covered\":%lu", daikinTz.dateTime(win.start, RFC3339).c_str(), (unsigned long)win.covered);
+  for (uint8_t t = 0; t < ROLLUP_TEMPS; t++) {
+    const char *name = acFields[rollupFields[t]].name;
+    if ( win.covered == 0 ){
+      len += snprintf(payload + len, sizeof(payload) - len, ",\"%s\":null", name);
     } else {
-      res += bytes[i];
+      len += snprintf(payload + len, sizeof(payload) - len, ",\"%s\":{\"min\":%.1f,\"max\":%.1f,\"mean\":%.1f}", name, win.min[t] / 10.0, win.max[t] / 10.0, win.mean(t) / 10.0);
     }
   }
-  return res;
+  snprintf(payload + len, sizeof(payload) - len, ",\"compressor_on\":%lu,\"duty\":%lu,\"starts\":%u,\"load\":%.1f}",
+    (unsigned long)win.compressorOn, (unsigned long)(win.covered ? win.compressorOn * 100ULL / win.covered : 0), win.starts, win.load / 3600.0);
+  if ( mqttClient.publish(topic, payload, true) ){
+    rollups[port.id].closed &= ~(1 << w);
+  }
 }
-std::string str_repr(std::vector<uint8_t> &bytes) {
-  return str_repr(&bytes[0], bytes.size());
+//clock, windows closed also without samples, closed windows to mqtt and saving, once a second
+void rollupLoop() {
+  if ( millis() - lastRollupRoll < 1000UL ){
+    return;
+  }
+  lastRollupRoll = millis();
+  if ( timeStatus() == timeNotSet ){
+    return;
+  }
+  rollupClock = daikinTz.now() - millis() / 1000;
+  bool publish = config.mqttControlEnable == true && mqttClient.connected();
+  for (uint8_t i = 0; i < s21PortsCount; i++) {
+    rollup &r = rollups[i];
+    r.roll(rollupClock + millis() / 1000);
+    for (uint8_t w = 0; w < ROLLUP_WINDOWS; w++) {
+      if ( !(r.closed & (1 << w)) ){
+        continue;
+      }
+      if ( publish ){
+        rollupPublish(*s21Ports[i], w);
+      } else if ( config.mqttControlEnable == false ){
+        r.closed &= ~(1 << w);
+      }
+    }
+  }
+  if ( millis() - lastRollupSave > ROLLUP_SAVE_INTERVAL * 1000UL ){
+    lastRollupSave = millis();
+    rollupSave();
+  }
 }
 
-void write_frame(std::vector<uint8_t> frame) {
-  //clearing serial buffer
-  daikinSWSerial.flush();
-  //writing command to serial
-  daikinSWSerial.write(STX);
-  daikinSWSerial.write(&frame[0], frame.size());
-  debugD("Writing frame contents: %s", str_repr(&frame[0], frame.size()).c_str());
-  daikinSWSerial.write(s21_checksum(&frame[0], frame.size()));
-  daikinSWSerial.write(ETX);
+//Home Assistant discovery: a climate entity and its sensors for each port, retained
+void mqttPublishDiscoveryDoc(const char *component, const char *uid, const char *object, JsonDocument &doc) {
+  char topic[128];
+  snprintf(topic, sizeof(topic), "homeassistant/%s/%s/%s/config", component, uid, object);
+  //streamed, it does not fit the mqtt buffer
+  if ( doc.overflowed() ){
+    debugE("MQTT discovery of %s %s doesn't fit in %u bytes", component, object, doc.capacity());
+  }
+  mqttClient.beginPublish(topic, measureJson(doc), true);
+  serializeJson(doc, mqttClient);
+  mqttClient.endPublish();
 }
-
-void dumpState() {
-  debugI("** BEGIN STATE *****************************");
-  debugI("     Power: %i", acValues.power_on);
-  debugI("      Mode: %s", mode_to_string(acValues.mode).c_str());
-  debugI("    Target: %.1f C", acValues.setpoint / 10.0);
-  debugI("       Fan: %s (Target: %d rpm - actual: %d rpm)", speed_to_string(acValues.fan).c_str(), acValues.target_fan_rpm, acValues.fan_rpm);
-  debugI("     Swing: H:%i V:%i", acValues.swing_h, acValues.swing_v);
-  debugI("    Inside: %.1f C", acValues.temp_inside / 10.0);
-  debugI("   Outside: %.1f C", acValues.temp_outside / 10.0);
-  debugI("      Coil: %.1f C", acValues.temp_coil / 10.0);
-  debugI("       Lid: Target: %d° - Actual: %d°", acValues.target_angle, acValues.angle);
-  debugI("Compressor: %s (%d Hz)", acValues.idle ? "idle" : "active", acValues.compressor_freq);
-  debugI("** END STATE *****************************");
+void mqttPublishDiscovery(S21Port &port) {
+  char uid[32], name[48], buf[72], topic[96];
+  snprintf(uid, sizeof(uid), "wiredDaikin_%06X_%u", ESP.getChipId(), port.id);
+  if ( port.id == 0 ){
+    snprintf(name, sizeof(name), "%s", config.hostname);
+  } else {
+    snprintf(name, sizeof(name), "%s %u", config.hostname, port.id);
+  }
+  const char *base = portTopic(buf, sizeof(buf), config.mqttPubTopic, port.id);
+  //the climate entity is the largest: 24 members, the device, 4 lists and copies of its 12 topics, ids and names
+  DynamicJsonDocument doc(JSON_OBJECT_SIZE(24) + JSON_OBJECT_SIZE(4) + JSON_ARRAY_SIZE(1) + JSON_ARRAY_SIZE(6)
+    + JSON_ARRAY_SIZE(sizeof(speeds)) + 2 * JSON_ARRAY_SIZE(2)
+    + 12 * sizeof(topic) + 2 * sizeof(uid) + sizeof(name) + sizeof(config.mqttTestamentTopic));
+  //char arrays are copied by the document, literals are not
+  auto setTopic = [&](const char *key, const char *field, const char *suffix){
+    snprintf(topic, sizeof(topic), "%s/%s%s", base, field, suffix);
+    doc[key] = (char*)topic;
+  };
+  auto setDevice = [&](){
+    doc["availability_topic"] = config.mqttTestamentTopic;
+    JsonObject device = doc.createNestedObject("device");
+    device.createNestedArray("identifiers").add(uid);
+    device["name"] = name;
+    device["manufacturer"] = "Daikin";
+    device["model"] = "S21";
+  };
+
+  doc["name"] = nullptr; //entity is named as the device
+  doc["unique_id"] = uid;
+  setDevice();
+  JsonArray modes = doc.createNestedArray("modes");
+  for (const char *mode : {"auto", "off", "dry", "cool", "heat", "fan_only"}) {
+    modes.add(mode);
+  }
+  setTopic("mode_state_topic", "hvac_mode", "");
+  setTopic("mode_command_topic", "hvac_mode", "/set");
+  setTopic("power_command_topic", "power", "/set");
+  setTopic("temperature_state_topic", "setpoint", "");
+  setTopic("temperature_command_topic", "setpoint", "/set");
+  setTopic("current_temperature_topic", "temp_inside", "");
+  JsonArray fanModes = doc.createNestedArray("fan_modes");
+  for (uint8_t i = 0; i < sizeof(speeds); i++) {
+    fanModes.add(speed_to_string(speeds[i]));
+  }
+  setTopic("fan_mode_state_topic", "fan", "");
+  setTopic("fan_mode_command_topic", "fan", "/set");
+  JsonArray swingModes = doc.createNestedArray("swing_modes");
+  swingModes.add("ON");
+  swingModes.add("OFF");
+  setTopic("swing_mode_state_topic", "swing_v", "");
+  setTopic("swing_mode_command_topic", "swing_v", "/set");
+  JsonArray swingHModes = doc.createNestedArray("swing_horizontal_modes");
+  swingHModes.add("ON");
+  swingHModes.add("OFF");
+  setTopic("swing_horizontal_mode_state_topic", "swing_h", "");
+  setTopic("swing_horizontal_mode_command_topic", "swing_h", "/set");
+  doc["min_temp"] = 18;
+  doc["max_temp"] = 32;
+  doc["precision"] = 1.0;
+  doc["temp_step"] = 1;
+  mqttPublishDiscoveryDoc("climate", uid, "climate", doc);
+
+  //sensors: field, name, device class, unit
+  const char *sensors[][4] = {
+    {"temp_outside", "Outside temperature", "temperature", "°C"},
+    {"temp_coil", "Coil temperature", "temperature", "°C"},
+    {"fan_rpm", "Fan speed", nullptr, "rpm"},
+    {"compressor_freq", "Compressor frequency", "frequency", "Hz"}
+  };
+  for (auto &sensor : sensors) {
+    doc.clear();
+    char sensorUid[48];
+    snprintf(sensorUid, sizeof(sensorUid), "%s_%s", uid, sensor[0]);
+    doc["name"] = sensor[1];
+    doc["unique_id"] = sensorUid;
+    setDevice();
+    setTopic("state_topic", sensor[0], "");
+    if ( sensor[2] ){
+      doc["device_class"] = sensor[2];
+    }
+    doc["unit_of_measurement"] = sensor[3];
+    doc["state_class"] = "measurement";
+    mqttPublishDiscoveryDoc("sensor", uid, sensor[0], doc);
+  }
+  //compressor running is the opposite of idle
+  doc.clear();
+  doc["name"] = "Compressor";
+  char sensorUid[48];
+  snprintf(sensorUid, sizeof(sensorUid), "%s_compressor", uid);
+  doc["unique_id"] = sensorUid;
+  setDevice();
+  setTopic("state_topic", "idle", "");
+  doc["payload_on"] = "OFF";
+  doc["payload_off"] = "ON";
+  doc["device_class"] = "running";
+  mqttPublishDiscoveryDoc("binary_sensor", uid, "compressor", doc);
 }
 
-//mqtt functions
 void mqttCallback(char* topic, byte* payload, unsigned int length) {
-  debugD("MQTT Message arrived on topic %s (payload: %s)", topic, (char*)payload);
+  debugD("MQTT Message arrived on topic %s (payload: %.*s)", topic, length, (char*)payload);
+
+  //plain value commands, <pubTopic>[/port]/<field>/set, are queued as "<field>=<value>"
+  char buf[72];
+  for (uint8_t i = 0; i < s21PortsCount; i++) {
+    const char *base = portTopic(buf, sizeof(buf), config.mqttPubTopic, i);
+    size_t baseLen = strlen(base);
+    if ( strncmp(topic, base, baseLen) != 0 || topic[baseLen] != '/' ){
+      continue;
+    }
+    const char *field = topic + baseLen + 1;
+    const char *end = strchr(field, '/');
+    if ( !end || strcmp(end, "/set") != 0 ){
+      continue;
+    }
+    char msg[CMD_MAX_LEN];
+    int len = snprintf(msg, sizeof(msg), "%.*s=%.*s", (int)(end - field), field, (int)length, (char*)payload);
+    if ( len >= (int)sizeof(msg) || !cmdEnqueue(SRC_MQTT, msg, len, i) ){
+      debugE("MQTT command dropped, queue full or message too long");
+    }
+    return;
+  }
 
-  //easy approach: just put the payload received in the local wsTxt var for working in loop
-  strcpy(wsTxt, (char*)payload);
-  debugD("%s", wsTxt);
+  //finding the port from the topic
+  uint8_t port = 0;
+  for (uint8_t i = 1; i < s21PortsCount; i++) {
+    if ( strcmp(topic, portTopic(buf, sizeof(buf), config.mqttSubTopic, i)) == 0 ){
+      port = i;
+    }
+  }
+  //queue message for loop
+  if ( !cmdEnqueue(SRC_MQTT, (char*)payload, length, port) ){
+    debugE("MQTT command dropped, queue full or message too long");
+  }
 }
 
 uint32_t mqttConnAttempt = 0; //don't want tons of useless connections attemps
@@ -522,7 +1734,15 @@ bool mqttConnect() {
         // ... and resubscribe
         const char* sysAvailable = "online";
         mqttClient.publish(config.mqttTestamentTopic, sysAvailable, true);
-        mqttClient.subscribe(config.mqttSubTopic);
+        char buf[72], topic[96];
+        for (uint8_t i = 0; i < s21PortsCount; i++) {
+          mqttClient.subscribe(portTopic(buf, sizeof(buf), config.mqttSubTopic, i));
+          snprintf(topic, sizeof(topic), "%s/+/set", portTopic(buf, sizeof(buf), config.mqttPubTopic, i));
+          mqttClient.subscribe(topic);
+          //announcing the unit to HA, and publishing every field again
+          mqttPublishDiscovery(*s21Ports[i]);
+          mqttDirty[i] = (1UL << MQTT_FIELDS_COUNT) - 1;
+        }
         return true;
       } else {
         debugE("Failed mqtt connection with RC=%i", mqttClient.state());
@@ -542,10 +1762,10 @@ bool mqttConnect() {
 void processCmdRemoteDebug();
 
 void setup() {
-  Serial.begin(115200);
-  daikinSWSerial.enableTxGPIOOpenDrain(true);
-  daikinSWSerial.begin(2400, EspSoftwareSerial::SWSERIAL_8E2, D7, D6, false);
-  daikinSWSerial.setTimeout(1000);
+  logSerial.begin(115200);
+  for (uint8_t i = 0; i < s21PortsCount; i++) {
+    s21Ports[i]->serial.begin();
+  }
   // need to store config data in eeprom
   EEPROM.begin(sizeof(config));
   //getting actual config
@@ -572,9 +1792,32 @@ void setup() {
     strcpy(config.mqttPubTopic, "pubTopic");
   
     config.period = 15;
+    //unknown unit, to be discovered
+    for (uint8_t i = 0; i < S21_MAX_PORTS; i++) {
+      config.capabilitiesCheck[i] = 0;
+      config.capabilities[i] = 0;
+    }
     EEPROM.put(0,config);
     EEPROM.commit();  
   }
+  //first boot with telemetry filtering
+  if ( config.filterCheck != 113 ){
+    config.filterCheck = 113;
+    for (uint8_t i = 0; i < AC_FIELDS_COUNT; i++) {
+      config.deadBand[i] = 0;
+    }
+    config.deadBand[AC_TEMP_INSIDE] = 3;
+    config.deadBand[AC_TEMP_OUTSIDE] = 3;
+    config.deadBand[AC_TEMP_COIL] = 3;
+    config.deadBand[AC_COMPRESSOR_FREQ] = 2;
+    config.deadBand[AC_FAN_RPM] = 20;
+    config.wsMinInterval = 0;
+    config.wsMaxInterval = 0;
+    config.mqttMinInterval = 10;
+    config.mqttMaxInterval = 600;
+    EEPROM.put(0,config);
+    EEPROM.commit();
+  }
 
   //mqtt
   mqttClient.setCallback(mqttCallback);
@@ -597,18 +1840,24 @@ void setup() {
   wifiConnManager.setAPCallback(configModeCallback);
   //and one to remove that persistency
   wifiConnManager.setSaveConfigCallback(saveConfigCallback);
+#ifdef S21_TRANSPORT_HWUART
+  //Serial is already the s21 bus: WiFiManager and ezTime are silenced, or their messages would go to the unit.
+  //RemoteDebug's serial output is turned off below
+  wifiConnManager.setDebugOutput(false);
+  setDebug(NONE);
+#endif
 
   //fetches ssid and pass and tries to connect
   //if it does not connect it starts an access point with the specified name
   //here  "AutoConnectAP"
   //and goes into a blocking loop awaiting configuration
   if(!wifiConnManager.autoConnect(apname)) {
-    Serial.println("failed to connect and hit timeout");
+    logSerial.println("failed to connect and hit timeout");
     //reset and try again, or maybe put it to deep sleep
     ESP.restart();
   }
   
-  Serial.printf("Writing new hostname value <%s> to EEPROM\n", hostnameParam.getValue());
+  logSerial.printf("Writing new hostname value <%s> to EEPROM\n", hostnameParam.getValue());
   strcpy(config.hostname, hostnameParam.getValue());
   //write eeprom
   EEPROM.put(0, config);
@@ -623,7 +1872,12 @@ void setup() {
 	Debug.showProfiler(true); // Profiler (Good to measure times, to optimize codes)
 	Debug.showColors(true); // Colors
   Debug.showColors(true); // Colors
+#ifdef S21_TRANSPORT_HWUART
+  //serial is the s21 bus
+  Debug.setSerialEnabled(false);
+#else
   Debug.setSerialEnabled(true);
+#endif
   //callback to manage custom commands
   String helpCmd = "millis      -> Return actual millis() counter\r\n";
     helpCmd.concat("time        -> Return actual server time\r\n");
@@ -633,20 +1887,33 @@ void setup() {
     helpCmd.concat("resetWiFi   -> Reset WiFi\r\n");
     helpCmd.concat("settings    -> Dump settings\r\n");
     helpCmd.concat("acvalues    -> Dump AC values\r\n");
+    helpCmd.concat("cmdqueue    -> Dump command queues stats\r\n");
+    helpCmd.concat("busstats    -> Dump S21 bus timings\r\n");
+    helpCmd.concat("discover    -> Probe S21 registers supported by the unit\r\n");
     helpCmd.concat("\r\n");
   Debug.setHelpProjectsCmds(helpCmd);
 	Debug.setCallBackProjectCmds(&processCmdRemoteDebug);
 
-  Serial.print("Setting up timeserver");
+  logSerial.print("Setting up timeserver");
   if (!ezt::waitForSync(10)){
-    Serial.println("Can't sync timeserver");
+    logSerial.println("Can't sync timeserver");
   }
   daikinTz.setLocation(F("Europe/Rome"));
   daikinTz.setPosix(F("CET-1CEST,M3.5.0/2,M10.5.0/3"));
-  Serial.println("Done");
-
-  //resetting lastread
-  lastRead = - config.period * 1000U;
+  logSerial.println("Done");
+
+  for (uint8_t i = 0; i < s21PortsCount; i++) {
+    S21Port &port = *s21Ports[i];
+    //first boot, capabilities never discovered, or discovered with another registers table
+    if ( config.capabilitiesCheck[i] == 112 && config.capabilitiesTable == registersHash() ){
+      port.acCapabilities = config.capabilities[i];
+      port.acCapabilitiesKnown = true;
+    } else {
+      port.startDiscovery();
+    }
+    //polling every register on first loop
+    port.acRegForced = port.supportedMask();
+  }
 
   //OTA section
   // Port defaults to 8266
@@ -698,11 +1965,15 @@ void setup() {
     debugE("An Error has occurred while mounting LittleFS");
     return;
   } 
+  rollupLoad();
 
-  //base routes to html and js files
+  //base routes to html and js files. Gzipped ones first, when there are: plain ones are the fallback
   server.onNotFound([](AsyncWebServerRequest *request){
     request->send(404);
   });
+  if ( serveAssets() == 0 ){
+    debugE("No gzipped web assets, serving plain files");
+  }
   server.on("/", HTTP_GET, [](AsyncWebServerRequest *request){
     if(config.httpAuthEnable == true && !request->authenticate(config.httpUser, config.httpPass))
       return request->requestAuthentication();
@@ -718,42 +1989,101 @@ void setup() {
     request->send(LittleFS, "/favicon.ico", "image/x-icon");
   }).setFilter(ON_STA_FILTER);
 
+  //history, for the web page and for exports: ?port=&from=&to= (epoch, last 24 hours by default, everything until time is synced),
+  //&fields=<comma separated names> (all by default), &format=json (CSV by default)
+  server.on("/history", HTTP_GET, [](AsyncWebServerRequest *request) {
+    if(config.httpAuthEnable == true && !request->authenticate(config.httpUser, config.httpPass))
+      return request->requestAuthentication();
+    S21Port *port = s21Port(request->hasParam("port") ? request->getParam("port")->value().toInt() : 0);
+    if ( !port ){
+      request->send(404, "application/json", "{\"error\":\"no such port\"}");
+      return;
+    }
+    if ( historyExports >= HISTORY_MAX_EXPORTS ){
+      request->send(503, "application/json", "{\"error\":\"too many exports\"}");
+      return;
+    }
+    historyExport *e = new historyExport();
+    e->port = port->id;
+    e->next = histories[port->id].stored;
+    if ( request->hasParam("from") ){
+      e->from = request->getParam("from")->value().toInt();
+    } else if ( timeStatus() != timeNotSet ){
+      e->from = UTC.now() - SECS_PER_DAY;
+    } //else not synced yet, there's no last 24 hours: from the oldest sample
+    if ( request->hasParam("to") ){
+      e->to = request->getParam("to")->value().toInt();
+    }
+    e->json = request->hasParam("format") && request->getParam("format")->value() == "json";
+    String list = "," + (request->hasParam("fields") ? request->getParam("fields")->value() : String()) + ",";
+    for (uint8_t v = 0; v < HISTORY_VALUES; v++) {
+      if ( list == ",," || list.indexOf("," + String(acFields[historyFields[v]].name) + ",") >= 0 ){
+        e->fields |= 1 << v;
+      }
+    }
+    //header
+    int len = e->json ? snprintf(e->line, sizeof(e->line), "{\"port\":%u,\"fields\":[\"time\"", port->id) : snprintf(e->line, sizeof(e->line), "time");
+    for (uint8_t v = 0; v < HISTORY_VALUES; v++) {
+      if ( e->fields & (1 << v) ){
+        len += snprintf(e->line + len, sizeof(e->line) - len, e->json ? ",\"%s\"" : ",%s", acFields[historyFields[v]].name);
+      }
+    }
+    len += snprintf(e->line + len, sizeof(e->line) - len, e->json ? "],\"rows\":[\n" : "\n");
+    e->lineLen = len;
+    //files are not rotated or appended to until the export is over
+    historyExports++;
+    request->onDisconnect([e](){
+      delete e;
+      historyExports--;
+    });
+    AsyncWebServerResponse *response = request->beginChunkedResponse(e->json ? "application/json" : "text/csv", [e](uint8_t *buffer, size_t maxLen, size_t index) -> size_t {
+      return e->fill(buffer, maxLen);
+    });
+    request->send(response);
+  }).setFilter(ON_STA_FILTER);
+
+  //metrics, for Prometheus
+  server.on("/metrics", HTTP_GET, [](AsyncWebServerRequest *request) {
+    if(config.httpAuthEnable == true && !request->authenticate(config.httpUser, config.httpPass))
+      return request->requestAuthentication();
+    sendMetrics(request);
+  }).setFilter(ON_STA_FILTER);
+
   if ( config.httpControlEnable == true ){
     //returns info.
     server.on("/state", HTTP_GET, [](AsyncWebServerRequest *request) {
         if(config.httpAuthEnable == true && !request->authenticate(config.httpUser, config.httpPass))
           return request->requestAuthentication();
-        AsyncResponseStream *response = request->beginResponseStream("application/json");
-        StaticJsonDocument<256> root;
-        root["type"] = "sensor";
-        root["power"] = acValues.power_on;
-        root["mode"] = acValues.mode;
-        root["fan"] = acValues.fan;
-        root["setpoint"] = acValues.setpoint;
-        root["swing_v"] = acValues.swing_v;
-        root["swing_h"] = acValues.swing_h;
-        root["temp_inside"] = acValues.temp_inside;
-        root["temp_outside"] = acValues.temp_outside;
-        root["temp_coil"] = acValues.temp_coil;
-        root["target_fan_rpm"] = acValues.target_fan_rpm;
-        root["fan_rpm"] = acValues.fan_rpm;
-        root["idle"] = acValues.idle;
-        root["compressor_freq"] = acValues.compressor_freq;
-        root["target_angle"] = acValues.target_angle;
-        root["angle"] = acValues.angle;
-        serializeJson(root, *response);
-        request->send(response);
+        //port is optional, 0 by default
+        S21Port *port = s21Port(request->hasParam("port") ? request->getParam("port")->value().toInt() : 0);
+        if ( !port ){
+          request->send(404, "application/json", "{\"error\":\"no such port\"}");
+          return;
+        }
+        //long-poll, if the client has this version already
+        if ( request->hasParam("since") && (uint32_t)request->getParam("since")->value().toInt() == port->valuesVersion ){
+          long wait = request->hasParam("wait") ? request->getParam("wait")->value().toInt() : STATE_MAX_WAIT;
+          if ( !stateWait(request, *port, port->valuesVersion, constrain(wait, 0L, (long)STATE_MAX_WAIT)) ){
+            request->send(503, "application/json", "{\"error\":\"too many waiting\"}");
+          }
+          return;
+        }
+        sendState(request, *port, false);
     }).setFilter(ON_STA_FILTER);
 
-    //accepts command, same format
+    //accepts command, same format, or an array of commands whose ac settings are sent together
     AsyncCallbackJsonWebHandler *handler = new AsyncCallbackJsonWebHandler("/control", [](AsyncWebServerRequest *request, JsonVariant &json) {
-      StaticJsonDocument<256> data;
-      if (json.is<JsonArray>()){
-        data = json.as<JsonArray>();
-      } else if (json.is<JsonObject>()){
-        data = json.as<JsonObject>();
+      if ( !json.is<JsonArray>() && !json.is<JsonObject>() ){
+        request->send(400, "application/json", "{\"received\":false}");
+        return;
       }
-      serializeJson(data, wsTxt);
+      char *slot = measureJson(json) < CMD_MAX_LEN ? cmdReserve(SRC_HTTP) : nullptr;
+      if ( !slot ){
+        request->send(503, "application/json", "{\"received\":false}");
+        return;
+      }
+      serializeJson(json, slot, CMD_MAX_LEN);
+      cmdCommit(SRC_HTTP);
       request->send(200, "application/json", "{\"received\":true}");
     });
     if ( config.httpAuthEnable == true ){
@@ -768,6 +2098,14 @@ void setup() {
   }
   ws.onEvent(onWsEvent);
   server.addHandler(&ws);
+  //server-sent events, same authentication
+  if ( config.httpAuthEnable == true ){
+    events.setAuthentication(config.httpUser, config.httpPass);
+  }
+  events.onConnect(onEventsConnect);
+  server.addHandler(&events);
+  //hardware random, WiFi is on
+  etagSalt = ESP.random();
   server.begin();
   
   //we are up. Setting up start time message
@@ -775,620 +2113,459 @@ void setup() {
 
 }
 
-void loop() {
-  if ( millis() - lastRead > config.period * 1000UL ) {
-    lastRead = millis();
-    if( state > 0 ){
-      debugE("AC not ready to start update, state is still %i", state);
-    } else {
-      debugD("Starting AC update.");
-      state = 1;
-      acQuery = 0;
-      updateStartTime = millis();
-    }
-  }
-
-  //states-machine part
-  if ( state > 0 ){
-    if ( state == 1 ){ //state 1: sending query
-      //state of querying
-      if ( acQuery < acQueries.size() ){
-        //sending query
-        std::vector<uint8_t> code(acQueries[acQuery].begin(), acQueries[acQuery].end());
-        write_frame(code);
-        //starting serial timeout counter
-        serialTimeoutStart = millis();
-        //going to next state
-        state = 2;
-      } else {
-        //over with queryes, let's go back to idle
-        state = 0;
-        //resetting indes
-        acQuery = 0;
-        //showing values
-        dumpState();
-        if ( valueChanged ){
-          debugD("Values changed!");
-          //sending values to clients
-          sendSensorDataWs(0);
-          //publishing on mqtt
-          if ( config.mqttControlEnable == true ){
-            if (mqttClient.connected() || mqttConnect() ){
-              debugD("Publishing values");
-              DynamicJsonDocument root(512);
-              root["type"] = "sensor";
-              root["power"] = acValues.power_on;
-              root["mode"] = acValues.mode;
-              root["fan"] = acValues.fan;
-              root["setpoint"] = acValues.setpoint;
-              root["swing_v"] = acValues.swing_v;
-              root["swing_h"] = acValues.swing_h;
-              root["temp_inside"] = acValues.temp_inside;
-              root["temp_outside"] = acValues.temp_outside;
-              root["temp_coil"] = acValues.temp_coil;
-              root["target_fan_rpm"] = acValues.target_fan_rpm;
-              root["fan_rpm"] = acValues.fan_rpm;
-              root["idle"] = acValues.idle;
-              root["compressor_freq"] = acValues.compressor_freq;
-              root["target_angle"] = acValues.target_angle;
-              root["angle"] = acValues.angle;
-            
-              char buffer[512];
-              serializeJson(root, buffer);
-              mqttClient.publish(config.mqttPubTopic, buffer, true);
-            };
-          }
-          //resetting boolean
-          valueChanged = false;
-        }
-        //and printing total time
-        debugI("Total update time: %.2fs", (millis()-updateStartTime)/1000.0);
-      }
-    } //end state 1: sending query
-    if ( state == 2 ){ //state 2: checking ACK
-      if ( !daikinSWSerial.available() && (millis()-serialTimeoutStart) > serialTimeout ){
-        //got no answer! error, going to state 5 to wait for the next command
-        debugE("Timeout waiting for ACK for query %s, timeout", acQueries[acQuery].c_str());
-        state = 5;
-      } else {
-        if ( daikinSWSerial.available() ){
-          //got an answer, check if it's an ACK
-          serialByte = daikinSWSerial.read();
-          if (serialByte == NAK) {
-            debugE("NAK from S21 for %s query", acQueries[acQuery].c_str());
-            //ko for this query, so going to state 5 to wait for the next command
-            state = 5;
-          }
-          if (serialByte != ACK) {
-            debugE("No ACK from S21 for %s query (received %i)", acQueries[acQuery].c_str(), serialByte);
-            //ko for this query, so going to state 5 to wait for the next command
-            state = 5;
-          }
-          state = 3;
-        }
-      }
-    } //end state 2: checking ACK
-    if ( state == 3 ){ //state 3: reading frame
-      if ( !frameReading ) {
-        //starts a new frame reading, so resetting buffer 
-        frameReading = true;
-        frameBytes.clear();
-        serialTimeoutStart = millis();
-      }
-      if ( !daikinSWSerial.available() && (millis()-serialTimeoutStart) > serialTimeout ){
-        //got no answer! error, going to state 5 to wait for the next command
-        debugE("Timeout waiting frame for query %s, timeout", acQueries[acQuery].c_str());
-        frameReading = false;
-        state = 5;
-      } else {
-        if ( daikinSWSerial.available() ){
-          //ok let's read a frame byte
-          serialByte = daikinSWSerial.read();
-          //i can also reset counter for next byte timeout
-          serialTimeoutStart = millis();
-          if (serialByte == ACK) {
-            debugE("Unexpected ACK waiting to read start of frame");
-          } else if ( !STXreceived && serialByte != STX) {
-            debugE("Unexpected byte waiting to read start of frame: %x", serialByte);
-          } else if (serialByte == STX) {
-            debugD("Received STX byte");
-            STXreceived = true;
-          } else if (serialByte == ETX) {
-            //frame ended
-            frameReading = false;
-            STXreceived = false;
-            //checking checksum
-            frameChecksum = frameBytes[frameBytes.size() - 1];
-            frameBytes.pop_back();
-            calcChecksum = s21_checksum(frameBytes);
-            if (calcChecksum != frameChecksum) {
-              debugE("Checksum mismatch: %x (frame) != %x (calc from %s)", frameChecksum, calcChecksum, hex_repr(&frameBytes[0], frameBytes.size()).c_str());
-              //as always, going to state 5 to wait for the next command
-              state = 5;
-            } else {
-              //everything seems ok, let's go to next state and parse the frame!
-              debugD("Correctly received frame: %s - %s", hex_repr(&frameBytes[0], frameBytes.size()).c_str(), str_repr(&frameBytes[0], frameBytes.size()).c_str());
-              state = 4;
-              //also sending an ACK to split
-              daikinSWSerial.write(ACK);
-            }
-          } else {
-            //the byte seems good for the buffer!
-            frameBytes.push_back(serialByte);
-          }
-        }
-      }
-    } //end state 3: reading frame
-    if ( state == 4 ){ //state 4: parse frame
-      //parsing frame and filling local vars if good
-      //for each value check if it has changed to limit network traffic over WS and MQTT
-      switch (frameBytes[0]) {
-        case 'G':      // F -> G
-          switch (frameBytes[1]) {
-            case '1':  // F1 -> G1 -- Basic State
-              if ( acValues.power_on != (bool)(frameBytes[2] == '1') ){
-                debugD("Power changed from %i to %i", acValues.power_on, (bool)(frameBytes[2] == '1'));
-                acValues.power_on = (frameBytes[2] == '1');
-                valueChanged = true;
-              }
-              if ( acValues.mode != (uint8_t)frameBytes[3] ){
-                debugD("Mode changed from %i to %i", acValues.mode, (uint8_t)frameBytes[3]);
-                acValues.mode = frameBytes[3];
-                valueChanged = true;
-              }
-              //FAN is taken from SG that has also night setting
-              //if ( acValues.fan != (uint8_t)frameBytes[5] && acValues.fan != 66 ){
-              //  debugD("Fan changed from %i to %i", acValues.fan, (uint8_t)frameBytes[5]);
-              //  acValues.fan = frameBytes[5];
-              //  valueChanged = true;
-              //}
-              if ( acValues.setpoint != (int16_t)((frameBytes[4] - 28) * 5) ){
-                //only valid if mode is different from DRY and FAN
-                if ( acValues.mode != 50 && acValues.mode != 54 ){
-                  debugD("Setpoint changed from %i to %i", acValues.setpoint, (int16_t)((frameBytes[4] - 28) * 5));
-                  acValues.setpoint = ((frameBytes[4] - 28) * 5);  // Celsius * 10
-                  valueChanged = true;
-                }
-              }
-              //debugD("Power is %i, mode is %s, setpoint is %i, fan is %s", acValues.power_on, mode_to_string(acValues.mode).c_str(), acValues.setpoint, speed_to_string(acValues.fan).c_str());
-              debugD("Power is %i, mode is %s, setpoint is %i", acValues.power_on, mode_to_string(acValues.mode).c_str(), acValues.setpoint);
-              break;
-            case '5':  // F5 -> G5 -- Swing state
-              if ( acValues.swing_v != (bool)(frameBytes[2] & 1) ){
-                debugD("SwingV changed from %i to %i", acValues.swing_v, (bool)(frameBytes[2] & 1));
-                acValues.swing_v = frameBytes[2] & 1;
-                valueChanged = true;
-              }
-              if ( acValues.swing_h != (bool)(frameBytes[2] & 2) ){
-                debugD("SwingH changed from %i to %i", acValues.swing_h, (bool)(frameBytes[2] & 2));
-                acValues.swing_h = frameBytes[2] & 2;
-                valueChanged = true;
-              }
-              debugD("V-Swing is %i, H-Swing is %i", acValues.swing_v, acValues.swing_h);
-              break;
-            case '3':  // F3 -> G3 -- Timer
-              debugD("Timer  is %i, ON timer %ih, OFF timer %ih", (frameBytes[2] - '0'), ((frameBytes[3] - 0x30)/6), ((frameBytes[4] - 0x30)/6));
-              break;
-          }
-          break;
-        case 'S':      // R -> S
-          switch (frameBytes[1]) {
-            case 'H':  // Inside temperature
-              if ( acValues.temp_inside != temp_bytes_to_c10(&frameBytes[2]) ){
-                debugD("Temp Inside changed from %i to %i", acValues.temp_inside, temp_bytes_to_c10(&frameBytes[2]));
-                acValues.temp_inside = temp_bytes_to_c10(&frameBytes[2]);
-                valueChanged = true;
-              }
-              debugD("Temp inside is %i", acValues.temp_inside);
-              break;
-            case 'I':  // Coil temperature
-              if ( acValues.temp_coil != temp_bytes_to_c10(&frameBytes[2]) ){
-                debugD("Temp Coil changed from %i to %i", acValues.temp_coil, temp_bytes_to_c10(&frameBytes[2]));
-                acValues.temp_coil = temp_bytes_to_c10(&frameBytes[2]);
-                valueChanged = true;
-              }
-              debugD("Temp coil is %i", acValues.temp_coil);
-              break;
-            case 'a':  // Outside temperature
-              if ( acValues.temp_outside != temp_bytes_to_c10(&frameBytes[2]) ){
-                debugD("Temp Outside changed from %i to %i", acValues.temp_outside, temp_bytes_to_c10(&frameBytes[2]));
-                acValues.temp_outside = temp_bytes_to_c10(&frameBytes[2]);
-                valueChanged = true;
-              }
-              debugD("Temp outside is %i", acValues.temp_outside);
-              break;
-            case 'L':  // Fan speed
-              if ( acValues.fan_rpm != (bytes_to_num(&frameBytes[2], frameBytes.size()-2) * 10) ){
-                debugD("Fan RPM changed from %i to %i", acValues.fan_rpm, (bytes_to_num(&frameBytes[2], frameBytes.size()-2) * 10));
-                acValues.fan_rpm = bytes_to_num(&frameBytes[2], frameBytes.size()-2) * 10;
-              }
-              debugD("Fan rpm is %i", acValues.fan_rpm);
-              break;
-            case 'd':  // Compressor state / frequency? Idle if 0.
-              if ( acValues.idle != (bool)(frameBytes[2] == '0' && frameBytes[3] == '0' && frameBytes[4] == '0') ){
-                debugD("Idle changed from %i to %i", acValues.idle, (bool)(frameBytes[2] == '0' && frameBytes[3] == '0' && frameBytes[4] == '0'));
-                acValues.idle = (frameBytes[2] == '0' && frameBytes[3] == '0' && frameBytes[4] == '0');
-                valueChanged = true;
-              }
-              if ( acValues.compressor_freq != bytes_to_num(&frameBytes[2], 3) ){
-                debugD("Compressor frequency changed from %i to %i", acValues.compressor_freq, bytes_to_num(&frameBytes[2], 3));
-                acValues.compressor_freq = bytes_to_num(&frameBytes[2], 3);
-                valueChanged = true;
-              }
-              debugD("Idle is %i. Compressor frequency is %iHz", acValues.idle, acValues.compressor_freq);
-              break;
-            case 'K':  // Fan speed target
-              if ( acValues.target_fan_rpm != bytes_to_num(&frameBytes[2], 3) * 10 ){
-                debugD("Target fan rpm changed from %i to %i", acValues.target_fan_rpm, bytes_to_num(&frameBytes[2], 3) * 10);
-                acValues.target_fan_rpm = bytes_to_num(&frameBytes[2], 3) * 10;
-                valueChanged = true;
-              }
-              debugD("Target fan rpm is %i", acValues.target_fan_rpm);
-              break;
-            case 'M':  // Target angle
-              if ( acValues.target_angle != bytes_to_num(&frameBytes[2], 3) ){
-                debugD("Target angle changed from %i to %i", acValues.target_angle, bytes_to_num(&frameBytes[2], 3));
-                acValues.target_angle = bytes_to_num(&frameBytes[2], 3);
-                valueChanged = true;
-              }                
-              debugD("Target angle is %i", acValues.target_angle);
-              break;
-            case 'N':  // Angle
-              if ( acValues.angle != bytes_to_num(&frameBytes[2], 3) ){
-                debugD("Angle changed from %i to %i", acValues.angle, bytes_to_num(&frameBytes[2], 3));
-                acValues.angle = bytes_to_num(&frameBytes[2], 3);
-              }
-              debugD("Angle is %i", acValues.angle);
-              break;
-            case 'G':  // Fan speed with night mode.
-              if ( acValues.fan != (uint8_t)frameBytes[2] ){
-                debugD("Fan changed from %i to %i", acValues.fan, (uint8_t)frameBytes[2]);
-                acValues.fan = frameBytes[2];
-                valueChanged = true;
-              }
-              debugD("Fan is %s", speed_to_string(acValues.fan).c_str());
-              break;
-            case 'g':  // Compressor state boolean.
-              debugD("Compressor state is %d", frameBytes[2] - '0');
-              break;
-            case 'A':  // Power state boolean.
-              debugD("Power state is %d", frameBytes[2] - '0');
-              break;
-            case 'B':  // Mode.
-              debugD("Mode is %d", frameBytes[2] - '0');
-              break;
-            case 'D':  // Timer on minutes.
-              debugD("Timer on minutes %d", bytes_to_num(&frameBytes[2], 3)*10);
-              break;
-            case 'E':  // Timer off minutes.
-              debugD("Timer off minutes %d", bytes_to_num(&frameBytes[2], 3)*10);
-              break;
-            case 'F':  // Swing Mode.
-              debugD("Swing Mode is %d", frameBytes[2] - '0');
-              break;
-            case 'X':  // Target temp
-              debugD("Target temp %i", bytes_to_num(&frameBytes[2], frameBytes.size()-2));
-              break;
-            default:
-              if (frameBytes.size() > 5) {
-                int8_t temp = temp_bytes_to_c10(&frameBytes[2]);
-                debugD("Unknown temp: %s -> %.1f C", str_repr(frameBytes).c_str(), temp / 10.0);
-              }
-          }
-          break;
-        default:
-          debugW("Unknown response %s ", str_repr(frameBytes).c_str());
-      }
-      //going to state to wait before next query
-      state = 5;
-    } //end state 4: parse frame
-    if ( state == 5 ){ //state 5: waiting
-      if ( !waiting ){
-        waitTimer = millis();
-        waiting = true;
-      } else {
-        if ( millis() - waitTimer > waitTimeout ){
-          //time to go back to business!
-          waiting = false;
-          state = 1;
-          acQuery++;
-        }
-      }
-    } //end state 5: waiting
-  } //end if state > 0
-
-  //we also have to manage commands! with a states-machine
-  if ( cmdState > 0 ){
-    if ( cmdState == 1 ){
-      //so we need to send a new command. Disable update and prepare sending new command
-      //if an update is en course, we need to wait some time to clear responses
-      if ( state > 0){
-        //so going to state 2 and wait a "serial Timeout time" before sending command
-        debugD("An update is en course, waiting a SERIALTIMEOUT before sending command");
-        cmdState = 2;
-        serialTimeoutStart = millis();
-      } else {
-        //we can skip to state 3 to send command
-        cmdState = 3;
-      }
-      state = 0;
-      //resetting indes
-      acQuery = 0;
-      //also avoid starting new updates
-      lastRead = millis();
-    } //end cmdState 1: disabling update and preparing sending new command
-    if ( cmdState == 2 ){ //cmdstate 2: waiting..
-      if ( serialTimeoutStart - millis() > serialTimeout ){
-        //go to state 3
-        cmdState = 3;
-      }
-    } //end cmdstate 2: waiting
-    if ( cmdState == 3 ){ //cmdstate 3: sending command
-      debugD("Sending AC Command %s", str_repr(&acCommand[0], acCommand.size()).c_str());
-      //now sending command
-      write_frame(acCommand);
-      //and wait for an ack!
-      serialTimeoutStart = millis();
-      cmdState = 4;
-    } //end cmdstate 3: sending command
-    if ( cmdState == 4 ){ //cmdstate 4: checking ACK
-      if ( !daikinSWSerial.available() && (millis()-serialTimeoutStart) > serialTimeout ){
-        //got no answer! error, going to state 5 to wait for the next command
-        debugE("Timeout waiting for ACK for command %s, timeout", str_repr(&acCommand[0], acCommand.size()).c_str());
-        cmdState = 0;
-        //triggering an update
-        lastRead = millis() - config.period * 1000UL;
-      } else {
-        if ( daikinSWSerial.available() ){
-          //got an answer, check if it's an ACK
-          serialByte = daikinSWSerial.read();
-          if (serialByte == NAK) {
-            debugE("NAK from S21 for %s command", str_repr(&acCommand[0], acCommand.size()).c_str());
-          } else if (serialByte != ACK) {
-            debugE("No ACK from S21 for %s command (received %i)", str_repr(&acCommand[0], acCommand.size()).c_str(), serialByte);
-          } else if (serialByte == ACK) {
-            debugI("Command %s acknowledged", str_repr(&acCommand[0], acCommand.size()).c_str());
-          }
-          //command over, good or bad
-          cmdState = 0;
-          //clearing command
-          acCommand.clear();
-          //triggering an update
-          lastRead = millis() - config.period * 1000UL;
-        }
-      }
-    } //end cmdstate 4: checking ack
-  } //end cmd state > 0
-
-  //management of clients commands in loop. Parameters' values could be checked for security..
-  if ( wsTxt[0] != '\0' ){
-    debugD("Working WS message <%s>.", wsTxt);
-    DynamicJsonDocument wsMsg(256);
-    auto error = deserializeJson(wsMsg, wsTxt);
-    if (error) {
-      debugE("deserializeJson() failed with code %s", error.c_str());
-      wsTxt[0] = '\0';
-      return;
+void publishFields(S21Port &port, uint32_t changed);
+//sends values of a port to WS clients and MQTT, if changed
+void publishValues(S21Port &port) {
+  if ( port.valueChanged ){
+    debugD("Port %u: values changed!", port.id);
+    publishFields(port, port.dirtyFields);
+    port.dirtyFields = 0;
+    //resetting boolean
+    port.valueChanged = false;
+  }
+}
+//sends changed fields to WS clients and mqtt, through their filters. Also called with no changes, for delayed ones
+void publishFields(S21Port &port, uint32_t changed) {
+  uint32_t wsFields = filterFields(SINK_WS, port, changed);
+  if ( wsFields ){
+    sensorSeq[port.id]++;
+    sendSensorDeltaWs(port, wsFields);
+    if ( events.count() > 0 ){
+      eventsSendSensor(nullptr, port);
     }
-    if ( wsMsg["command"].as<String>() == "rstDevice" ){
-      debugD("Resetting device");
-      ESP.restart();
+  }
+  uint32_t mqttFields = filterFields(SINK_MQTT, port, changed);
+  if ( mqttFields ){
+    mqttDirty[port.id] |= mqttFields;
+    if ( mqttFields & ((1UL << AC_POWER) | (1UL << AC_MODE)) ){
+      mqttDirty[port.id] |= 1UL << MQTT_HVAC_MODE;
     }
-    if ( wsMsg["command"].as<String>() == "rstWifi" ){
-      debugD("Resetting wifi");
-      WiFi.persistent(true);
-      wifiConnManager.resetSettings();
-      ESP.restart();
+    if ( config.mqttControlEnable == true ){
+      if (mqttClient.connected() || mqttConnect() ){
+        debugD("Publishing values");
+        mqttPublishFields(port);
+      };
     }
+  }
+}
 
-    //manage config settings
-    if ( wsMsg["command"].as<String>() == "config" ){
-      if ( wsMsg["target"].as<String>() == "period" ){
-        config.period = wsMsg["value"].as<byte>();
-        debugD("Updating period to %i", wsMsg["value"].as<byte>());
-      }
-      if ( wsMsg["target"].as<String>() == "hostname" ){
-        String hostname;
-        hostname = wsMsg["value"].as<String>();
-        hostname.toCharArray(config.hostname, 32);
-        WiFi.hostname(config.hostname);
-        debugD("Updating hostname to %s", hostname.c_str());
-        //need a reset
-        resetNeeded = true;
-      }
-      if ( wsMsg["target"].as<String>() == "httpEnable" ){
-        config.httpAuthEnable = wsMsg["value"].as<bool>();
-        debugD("Updating httpAuthEnable %d", wsMsg["value"].as<bool>());
-        //need a reset
-        resetNeeded = true;
-      }
-      if ( wsMsg["target"].as<String>() == "httpAccessData" ){
-        String user,pass;
-        user = wsMsg["username"].as<String>();
-        pass = wsMsg["password"].as<String>();    
-        
-        user.toCharArray(config.httpUser, 32);
-        pass.toCharArray(config.httpPass, 32);
-
-        debugD("Updating Http access data: User: %s - Pass: %s", user.c_str(), pass.c_str());
-        //need a reset
-        resetNeeded = true;
-      }
-      if ( wsMsg["target"].as<String>() == "httpControlEnable" ){
-        config.httpControlEnable = wsMsg["value"].as<bool>();
-        debugD("Updating httpControlEnable %d", wsMsg["value"].as<bool>());
-        //need a reset
-        resetNeeded = true;
-      }
-      if ( wsMsg["target"].as<String>() == "mqttControlEnable" ){
-        config.mqttControlEnable = wsMsg["value"].as<bool>();
-        debugD("Updating mqttControlEnable %d", wsMsg["value"].as<bool>());
-        //need a reset
-        resetNeeded = true;
-      }
-      if ( wsMsg["target"].as<String>() == "mqttAccessData" ){
-        String user,pass;
-        user = wsMsg["username"].as<String>();
-        pass = wsMsg["password"].as<String>();    
-        
-        user.toCharArray(config.mqttUser, 32);
-        pass.toCharArray(config.mqttPass, 32);
-
-        debugD("Updating Mqtt access data: User: %s - Pass: %s", user.c_str(), pass.c_str());
-        //need a reset
-        resetNeeded = true;
-      }
-      if ( wsMsg["target"].as<String>() == "mqttData" ){
-        String broker, testamentTopic, subTopic, pubTopic;
-        broker = wsMsg["broker"].as<String>();
-        testamentTopic = wsMsg["testamentTopic"].as<String>();    
-        subTopic = wsMsg["subTopic"].as<String>();    
-        pubTopic = wsMsg["pubTopic"].as<String>();    
-
-        broker.toCharArray(config.mqttBroker, 64);
-        testamentTopic.toCharArray(config.mqttTestamentTopic, 64);
-        subTopic.toCharArray(config.mqttSubTopic, 64);
-        pubTopic.toCharArray(config.mqttPubTopic, 64);
-
-        debugD("Updating Mqtt data: Broker: %s - SubTopic: %s - PubTopic: %s - TestamentTopic: %s", broker.c_str(), subTopic.c_str(), pubTopic.c_str(), testamentTopic.c_str());
-        //need a reset
-        resetNeeded = true;
-      }
+//s21 engine hooks
+constexpr uint8_t insideTempRegister = registerIndex("RH");
+static_assert(insideTempRegister < acRegistersCount, "rollups need the inside temperature register");
+void valuesParsed(S21Port &port) {
+  //once time is known and the inside temperature has been read
+  if ( rollupClock == 0 || port.acRegLastRead[insideTempRegister] == 0 ){
+    return;
+  }
+  int16_t temps[ROLLUP_TEMPS];
+  for (uint8_t t = 0; t < ROLLUP_TEMPS; t++) {
+    temps[t] = getField(port.acValues, rollupFields[t]);
+  }
+  rollups[port.id].add(rollupClock + millis() / 1000, temps, port.acValues.compressor_freq);
+}
+bool valuesWatched(S21Port &port) {
+  return ws.count() > 0 || events.count() > 0 || (config.mqttControlEnable == true && mqttClient.connected());
+}
+uint8_t pollPeriod() {
+  return config.period;
+}
+void saveCapabilities(S21Port &port) {
+  if ( config.capabilitiesTable != registersHash() ){
+    //the other ports' bitmaps are from the old table too
+    for (uint8_t i = 0; i < S21_MAX_PORTS; i++) {
+      config.capabilitiesCheck[i] = 0;
+    }
+    config.capabilitiesTable = registersHash();
+  }
+  config.capabilitiesCheck[port.id] = 112;
+  config.capabilities[port.id] = port.acCapabilities;
+  EEPROM.put(0,config);
+  EEPROM.commit();
+}
 
-      //now writing values to eeprom
-      debugD("Writing new config to eeprom");
-      EEPROM.put(0,config);
-      EEPROM.commit(); 
+//plain value commands from mqtt field topics, "<field>=<value>": no json here
+void processFieldCommand(const char *msg, uint8_t portId) {
+  S21Port *port = s21Port(portId);
+  const char *value = strchr(msg, '=');
+  if ( !port || !value ){
+    return;
+  }
+  size_t fieldLen = value++ - msg;
+  auto is = [&](const char *field){ return strlen(field) == fieldLen && strncmp(msg, field, fieldLen) == 0; };
+  bool on = strcasecmp(value, "ON") == 0 || strcasecmp(value, "true") == 0 || strcmp(value, "1") == 0;
+  uint8_t code;
+  if ( is("power") ){
+    port->setAcPower(on);
+  } else if ( is("hvac_mode") && (code = haModeCode(value)) != UINT8_MAX ){
+    port->setAcHaMode(code);
+  } else if ( is("mode") && (code = haModeCode(value)) != UINT8_MAX && code != 0 ){
+    port->setAcMode(code);
+  } else if ( is("fan") && (code = fanCode(value)) != 0 ){
+    port->setAcFan(code);
+  } else if ( is("setpoint") ){
+    port->setAcTemp(lround(atof(value)));
+  } else if ( is("swing_v") ){
+    port->setAcSwingV(on);
+  } else if ( is("swing_h") ){
+    port->setAcSwingH(on);
+  } else {
+    debugE("Unknown field command <%s>", msg);
+  }
+}
 
-      //we also need to send updated config to all clients
-      sendConfigWs(0);
+//inbound commands are dispatched on a hash of their names: FNV-1a, computed at compile time for the tables below,
+//which are checked to be collision free. The name is compared too, so unknown names are never taken for known ones.
+//Lookup is a linear scan of the hashes, not a perfect hash table: with a dozen entries a scan of integers is as fast
+constexpr uint32_t nameHash(const char *s, uint32_t h = 2166136261UL) {
+  return *s ? nameHash(s + 1, (uint32_t)((h ^ (uint8_t)*s) * 16777619UL)) : h;
+}
+template<typename H> struct nameEntry {
+  uint32_t hash;
+  const char *name;
+  H handler;
+};
+#define NAME_ENTRY(name, handler) {nameHash(name), name, handler}
+template<typename H, size_t N> constexpr bool hashesUnique(const nameEntry<H> (&table)[N], size_t i = 0, size_t j = 1) {
+  return i + 1 >= N ? true : j >= N ? hashesUnique(table, i + 1, i + 2) : table[i].hash != table[j].hash && hashesUnique(table, i, j + 1);
+}
+//handler of a name, nullptr if unknown
+template<typename H, size_t N> H nameLookup(const nameEntry<H> (&table)[N], const char *name) {
+  uint32_t hash = nameHash(name);
+  for (const nameEntry<H> &entry : table) {
+    if ( entry.hash == hash && strcmp(entry.name, name) == 0 ){
+      return entry.handler;
     }
+  }
+  return nullptr;
+}
 
-    //manage ac commands, split by single command so to ease HA integration
-    if ( wsMsg["command"].as<String>() == "acPower" ){
-      debugD("Sending AC Power: %i", wsMsg["power"].as<bool>());
-      
-      acCommand = {'D', '1',
-        (uint8_t)(wsMsg["power"].as<bool>() ? '1' : '0'),
-        (uint8_t) acValues.mode,
-        c10_to_setpoint_byte(acValues.setpoint),
-        (uint8_t) acValues.fan
-      };
+//config targets. Strings are copied from the document, no heap Strings
+typedef void (*configHandler)(JsonObject wsMsg);
+void configPeriod(JsonObject wsMsg) {
+  config.period = wsMsg["value"].as<byte>();
+  debugD("Updating period to %i", config.period);
+}
+void configDeadBand(JsonObject wsMsg) {
+  const char *field = wsMsg["field"] | "";
+  for (uint8_t i = 0; i < AC_FIELDS_COUNT; i++) {
+    if ( strcmp(field, acFields[i].name) == 0 && !(stateFields & (1UL << i)) ){
+      config.deadBand[i] = wsMsg["value"].as<uint16_t>();
+      debugD("Updating %s dead-band to %u", acFields[i].name, config.deadBand[i]);
+    }
+  }
+}
+void configWsIntervals(JsonObject wsMsg) {
+  config.wsMinInterval = wsMsg["min"].as<uint16_t>();
+  config.wsMaxInterval = wsMsg["max"].as<uint16_t>();
+  debugD("Updating WS publish intervals to %u-%us", config.wsMinInterval, config.wsMaxInterval);
+}
+void configMqttIntervals(JsonObject wsMsg) {
+  config.mqttMinInterval = wsMsg["min"].as<uint16_t>();
+  config.mqttMaxInterval = wsMsg["max"].as<uint16_t>();
+  debugD("Updating mqtt publish intervals to %u-%us", config.mqttMinInterval, config.mqttMaxInterval);
+}
+void configHostname(JsonObject wsMsg) {
+  strlcpy(config.hostname, wsMsg["value"] | "", sizeof(config.hostname));
+  WiFi.hostname(config.hostname);
+  debugD("Updating hostname to %s", config.hostname);
+  //need a reset
+  resetNeeded = true;
+}
+void configHttpEnable(JsonObject wsMsg) {
+  config.httpAuthEnable = wsMsg["value"].as<bool>();
+  debugD("Updating httpAuthEnable %d", config.httpAuthEnable);
+  //need a reset
+  resetNeeded = true;
+}
+void configHttpAccessData(JsonObject wsMsg) {
+  strlcpy(config.httpUser, wsMsg["username"] | "", sizeof(config.httpUser));
+  strlcpy(config.httpPass, wsMsg["password"] | "", sizeof(config.httpPass));
+  debugD("Updating Http access data: User: %s - Pass: %s", config.httpUser, config.httpPass);
+  //need a reset
+  resetNeeded = true;
+}
+void configHttpControlEnable(JsonObject wsMsg) {
+  config.httpControlEnable = wsMsg["value"].as<bool>();
+  debugD("Updating httpControlEnable %d", config.httpControlEnable);
+  //need a reset
+  resetNeeded = true;
+}
+void configMqttControlEnable(JsonObject wsMsg) {
+  config.mqttControlEnable = wsMsg["value"].as<bool>();
+  debugD("Updating mqttControlEnable %d", config.mqttControlEnable);
+  //need a reset
+  resetNeeded = true;
+}
+void configMqttAccessData(JsonObject wsMsg) {
+  strlcpy(config.mqttUser, wsMsg["username"] | "", sizeof(config.mqttUser));
+  strlcpy(config.mqttPass, wsMsg["password"] | "", sizeof(config.mqttPass));
+  debugD("Updating Mqtt access data: User: %s - Pass: %s", config.mqttUser, config.mqttPass);
+  //need a reset
+  resetNeeded = true;
+}
+void configMqttData(JsonObject wsMsg) {
+  strlcpy(config.mqttBroker, wsMsg["broker"] | "", sizeof(config.mqttBroker));
+  strlcpy(config.mqttTestamentTopic, wsMsg["testamentTopic"] | "", sizeof(config.mqttTestamentTopic));
+  strlcpy(config.mqttSubTopic, wsMsg["subTopic"] | "", sizeof(config.mqttSubTopic));
+  strlcpy(config.mqttPubTopic, wsMsg["pubTopic"] | "", sizeof(config.mqttPubTopic));
+  debugD("Updating Mqtt data: Broker: %s - SubTopic: %s - PubTopic: %s - TestamentTopic: %s", config.mqttBroker, config.mqttSubTopic, config.mqttPubTopic, config.mqttTestamentTopic);
+  //need a reset
+  resetNeeded = true;
+}
+constexpr nameEntry<configHandler> configTargets[] = {
+  NAME_ENTRY("period", configPeriod),
+  NAME_ENTRY("deadBand", configDeadBand),
+  NAME_ENTRY("wsIntervals", configWsIntervals),
+  NAME_ENTRY("mqttIntervals", configMqttIntervals),
+  NAME_ENTRY("hostname", configHostname),
+  NAME_ENTRY("httpEnable", configHttpEnable),
+  NAME_ENTRY("httpAccessData", configHttpAccessData),
+  NAME_ENTRY("httpControlEnable", configHttpControlEnable),
+  NAME_ENTRY("mqttControlEnable", configMqttControlEnable),
+  NAME_ENTRY("mqttAccessData", configMqttAccessData),
+  NAME_ENTRY("mqttData", configMqttData)
+};
+static_assert(hashesUnique(configTargets), "config target names hash collision");
+
+//commands. ac commands only merge their settings, S21Port::setAc sends them once the whole message is worked
+typedef void (*commandHandler)(JsonObject wsMsg, S21Port &port, acSettings &settings);
+void commandRstDevice(JsonObject wsMsg, S21Port &port, acSettings &settings) {
+  debugD("Resetting device");
+  ESP.restart();
+}
+void commandResync(JsonObject wsMsg, S21Port &port, acSettings &settings) {
+  //a client missed a delta, full values again only to it. Not from a WS client, to everyone
+  if ( !cmdClient ){
+    sendSensorDataWs(0, port);
+    return;
+  }
+  AsyncWebSocketClient *client = ws.client(cmdClient);
+  if ( client ){
+    sendSensorDataWs(client, port);
+  }
+}
+void commandDiscover(JsonObject wsMsg, S21Port &port, acSettings &settings) {
+  debugD("Starting S21 capability discovery on port %u", port.id);
+  port.startDiscovery();
+}
+void commandRstWifi(JsonObject wsMsg, S21Port &port, acSettings &settings) {
+  debugD("Resetting wifi");
+  WiFi.persistent(true);
+  wifiConnManager.resetSettings();
+  ESP.restart();
+}
+//manage config settings
+void commandConfig(JsonObject wsMsg, S21Port &port, acSettings &settings) {
+  configHandler handler = nameLookup(configTargets, wsMsg["target"] | "");
+  if ( !handler ){
+    debugE("Unknown config target");
+    return;
+  }
+  handler(wsMsg);
 
-      //triggering send command
-      cmdState = 1;
-    }
-    if ( wsMsg["command"].as<String>() == "acMode" ){
-      debugD("Sending AC Mode: %s", mode_to_string(wsMsg["mode"].as<uint8_t>()).c_str());
-      
-      acCommand = {'D', '1',
-        (uint8_t)(acValues.power_on ? '1' : '0'),
-        (uint8_t) modeToChar(wsMsg["mode"].as<uint8_t>()),
-        c10_to_setpoint_byte(acValues.setpoint),
-        (uint8_t) acValues.fan
-      };
+  //now writing values to eeprom
+  debugD("Writing new config to eeprom");
+  EEPROM.put(0,config);
+  EEPROM.commit(); 
+
+  //we also need to send updated config to all clients
+  sendConfigWs(0);
+}
+//ac commands, split by single command so to ease HA integration, or many at once with acSet
+void commandAcPower(JsonObject wsMsg, S21Port &port, acSettings &settings) {
+  if ( !wsMsg["power"].isNull() ) settings.setPower(wsMsg["power"].as<bool>());
+}
+void commandAcMode(JsonObject wsMsg, S21Port &port, acSettings &settings) {
+  if ( !wsMsg["mode"].isNull() ) settings.setMode(wsMsg["mode"].as<uint8_t>());
+}
+//needed for HA integration
+void commandAcHaMode(JsonObject wsMsg, S21Port &port, acSettings &settings) {
+  if ( !wsMsg["mode"].isNull() ) settings.setHaMode(wsMsg["mode"].as<uint8_t>());
+}
+void commandAcFan(JsonObject wsMsg, S21Port &port, acSettings &settings) {
+  if ( !wsMsg["fan"].isNull() ) settings.setFan(wsMsg["fan"].as<uint8_t>());
+}
+void commandAcTemp(JsonObject wsMsg, S21Port &port, acSettings &settings) {
+  if ( !wsMsg["temp"].isNull() ) settings.setTemp(wsMsg["temp"].as<int16_t>());
+}
+void commandAcSwingV(JsonObject wsMsg, S21Port &port, acSettings &settings) {
+  if ( !wsMsg["swingV"].isNull() ) settings.setSwingV(wsMsg["swingV"].as<bool>());
+}
+void commandAcSwingH(JsonObject wsMsg, S21Port &port, acSettings &settings) {
+  if ( !wsMsg["swingH"].isNull() ) settings.setSwingH(wsMsg["swingH"].as<bool>());
+}
+//any of power, mode, haMode, temp, fan, swingV and swingH
+void commandAcSet(JsonObject wsMsg, S21Port &port, acSettings &settings) {
+  commandAcPower(wsMsg, port, settings);
+  commandAcMode(wsMsg, port, settings);
+  if ( !wsMsg["haMode"].isNull() ) settings.setHaMode(wsMsg["haMode"].as<uint8_t>());
+  commandAcFan(wsMsg, port, settings);
+  commandAcTemp(wsMsg, port, settings);
+  commandAcSwingV(wsMsg, port, settings);
+  commandAcSwingH(wsMsg, port, settings);
+}
+constexpr nameEntry<commandHandler> commands[] = {
+  NAME_ENTRY("rstDevice", commandRstDevice),
+  NAME_ENTRY("resync", commandResync),
+  NAME_ENTRY("discover", commandDiscover),
+  NAME_ENTRY("rstWifi", commandRstWifi),
+  NAME_ENTRY("config", commandConfig),
+  NAME_ENTRY("acPower", commandAcPower),
+  NAME_ENTRY("acMode", commandAcMode),
+  NAME_ENTRY("acHaMode", commandAcHaMode),
+  NAME_ENTRY("acFan", commandAcFan),
+  NAME_ENTRY("acTemp", commandAcTemp),
+  NAME_ENTRY("acSwingV", commandAcSwingV),
+  NAME_ENTRY("acSwingH", commandAcSwingH),
+  NAME_ENTRY("acSet", commandAcSet)
+};
+static_assert(hashesUnique(commands), "command names hash collision");
+
+//one command. ac commands go to the port in the message, if any, or to defaultPort, and are only merged into settings
+void processMessage(JsonObject wsMsg, uint8_t defaultPort, acSettings *settings) {
+  S21Port *port = s21Port(wsMsg["port"] | defaultPort);
+  if ( !port ){
+    debugE("Command for a port that doesn't exist");
+    return;
+  }
+  commandHandler handler = nameLookup(commands, wsMsg["command"] | "");
+  if ( !handler ){
+    debugE("Unknown command");
+    return;
+  }
+  handler(wsMsg, *port, settings[port->id]);
+}
 
-      //triggering send command
-      cmdState = 1;
-    }
-    //needed for HA integration
-    if ( wsMsg["command"].as<String>() == "acHaMode" ){
-      if( wsMsg["mode"].as<uint8_t>() == 0 ){
-        debugD("Turning AC power off.");
-        acCommand = {'D', '1',
-          (uint8_t)'0',
-          (uint8_t) acValues.mode,
-          c10_to_setpoint_byte(acValues.setpoint),
-          (uint8_t) acValues.fan
-        };
+//management of clients commands. Parameters' values could be checked for security..
+//A message can be an array of commands: their ac settings are merged per port, so that a scene change is
+//at most one D1 and one D5 frame, whatever the number of commands.
+//Messages are parsed into cmdDoc, allocated once: parsing and dispatch don't use the heap. Parsing is in place, the strings
+//stay in the queue slot and only the JSON nodes take room in the pool
+StaticJsonDocument<512> cmdDoc;
+void processCommand(char *msg, uint8_t defaultPort, uint32_t client) {
+  uint32_t start = micros();
+  cmdPathActive = true;
+  cmdClient = client;
+  if ( msg[0] != '{' && msg[0] != '[' ){
+    debugD("Working field command <%s>.", msg);
+    processFieldCommand(msg, defaultPort);
+  } else {
+    debugD("Working WS message <%s>.", msg);
+    auto error = deserializeJson(cmdDoc, msg);
+    if ( error == DeserializationError::NoMemory ){
+      debugE("deserializeJson() failed: more members than %u bytes hold", cmdDoc.capacity());
+    } else if (error) {
+      debugE("deserializeJson() failed with code %s", error.c_str());
+    } else {
+      acSettings settings[S21_MAX_PORTS];
+      if ( cmdDoc.is<JsonArray>() ){
+        for (JsonVariant cmd : cmdDoc.as<JsonArray>()) {
+          processMessage(cmd.as<JsonObject>(), defaultPort, settings);
+        }
       } else {
-        debugD("Turning power on and setting AC Mode: %s", mode_to_string(wsMsg["mode"].as<uint8_t>()).c_str());
-        acCommand = {'D', '1',
-          (uint8_t)'1',
-          (uint8_t) modeToChar(wsMsg["mode"].as<uint8_t>()),
-          c10_to_setpoint_byte(acValues.setpoint),
-          (uint8_t) acValues.fan
-        };
+        processMessage(cmdDoc.as<JsonObject>(), defaultPort, settings);
       }
+      for (uint8_t i = 0; i < s21PortsCount; i++) {
+        if ( settings[i].fields ){
+          s21Ports[i]->setAc(settings[i]);
+        }
+      }
+    }
+  }
+  cmdPathActive = false;
+  cmdCount++;
+  cmdUs += micros() - start;
+}
 
-      //triggering send command
-      cmdState = 1;
-    }
-    if ( wsMsg["command"].as<String>() == "acFan" ){
-      debugD("Sending AC Fan: %s", speed_to_string(wsMsg["fan"].as<uint8_t>()).c_str());
-      
-      acCommand = {'D', '1',
-        (uint8_t)(acValues.power_on ? '1' : '0'),
-        (uint8_t) acValues.mode,
-        c10_to_setpoint_byte(acValues.setpoint),
-        (uint8_t) fanToChar(wsMsg["fan"].as<uint8_t>())
-      };
-
-      //triggering send command
-      cmdState = 1;
-    }
-    if ( wsMsg["command"].as<String>() == "acTemp" ){
-      debugD("Sending AC TargetTemp: %i", wsMsg["temp"].as<int16_t>());
-      
-      acCommand = {'D', '1',
-        (uint8_t)(acValues.power_on ? '1' : '0'),
-        (uint8_t) acValues.mode,
-        c10_to_setpoint_byte(wsMsg["temp"].as<int16_t>() * 10),
-        (uint8_t) acValues.fan
-      };
-
-      //triggering send command
-      cmdState = 1;
+void loop() {
+  loopStart();
+  loopCount++;
+  //polling split and sending commands
+  s21Loop();
+  loopMark(SEC_S21);
+
+  //management of clients commands, one at a time and only when the commands states-machines are free
+  //and the previous command has been read back, so that each command is built from the actual ac state.
+  //Gated on all ports: commands are rare, and this keeps them in order whatever port they are for
+  if ( s21CommandsReady() ){
+    uint8_t source, port;
+    uint32_t client;
+    char *msg = cmdPeek(source, port, client);
+    if ( msg ){
+      processCommand(msg, port, client);
+      cmdPop(source);
+    }
+  }
+  loopMark(SEC_COMMANDS);
+  
+  //loop and frame rates, over one minute windows
+  if ( millis() - statsWindowStart > 60000UL ){
+    uint32_t frames = 0;
+    for (uint8_t i = 0; i < s21PortsCount; i++) {
+      frames += s21Ports[i]->rxStats.frames;
+    }
+    loopRate = loopCount * 1000 / (millis() - statsWindowStart);
+    frameRate = (frames - framesTotal) * 1000 / (millis() - statsWindowStart);
+    framesTotal = frames;
+    for (uint8_t i = 0; i < s21PortsCount; i++) {
+      updatesRate[i] = (s21Ports[i]->updates - updatesTotal[i]) * 3600000ULL / (millis() - statsWindowStart);
+      updatesTotal[i] = s21Ports[i]->updates;
     }
-    if ( wsMsg["command"].as<String>() == "acSwingV" ){
-      //swing control command
-      debugD("Sending AC Swing Vertical command: %i", wsMsg["swingV"].as<bool>());
+    loopCount = 0;
+    statsWindowStart = millis();
+  }
 
-      acCommand = {'D', '5',
-        (uint8_t) ('0' + (acValues.swing_h ? 2 : 0) + (wsMsg["swingV"].as<bool>() ? 1 : 0) + (acValues.swing_h && wsMsg["swingV"].as<bool>() ? 4 : 0)),
-        (uint8_t) (wsMsg["swingV"].as<bool>() || acValues.swing_h ? '?' : '0'), 
-        '0', '0'
-      };
+  //long-polls on /state
+  stateWaitLoop();
 
-      //triggering send command
-      cmdState = 1;
-    }
-    if ( wsMsg["command"].as<String>() == "acSwingH" ){
-      //swing control command
-      debugD("Sending AC Swing Horizontal command: %i", wsMsg["swingH"].as<bool>());
+  //telemetry history and rollups
+  historySampleLoop();
+  historyStoreLoop();
+  rollupLoop();
 
-      acCommand = {'D', '5',
-        (uint8_t) ('0' + (wsMsg["swingH"].as<bool>() ? 2 : 0) + (acValues.swing_v ? 1 : 0) + (wsMsg["swingH"].as<bool>() && acValues.swing_v ? 4 : 0)),
-        (uint8_t) (acValues.swing_v || wsMsg["swingH"].as<bool>() ? '?' : '0'), 
-        '0', '0'
-      };
-      //triggering send command
-      cmdState = 1;
+  //telemetry held back by the filters, once a second
+  if ( millis() - lastFilterFlush > 1000UL ){
+    lastFilterFlush = millis();
+    for (uint8_t i = 0; i < s21PortsCount; i++) {
+      publishFields(*s21Ports[i], 0);
     }
-        
-    //clear the ws message - null terminate the first array element
-    wsTxt[0] = '\0';
   }
-  
-  //periodically send RSSI data to clients, if any
+  loopMark(SEC_TELEMETRY);
+
+  //periodically send RSSI data and bus stats to clients, if any
   if ( millis() - lastRssiSend > 30000UL ){
     lastRssiSend = millis();
     //sending RSSI to clients
     sendRssiWs(0);
+    for (uint8_t i = 0; i < s21PortsCount; i++) {
+      sendBusStatsWs(0, *s21Ports[i]);
+    }
   }
+  loopMark(SEC_CLIENTS);
 
   //time management
   ezt::events();
+  loopMark(SEC_TIME);
   //for OTA update
   ArduinoOTA.handle();
+  loopMark(SEC_OTA);
   //remote debug
   Debug.handle();
+  loopMark(SEC_DEBUG);
   //mqtt
   if ( config.mqttControlEnable == true ){
     if (mqttClient.connected() || mqttConnect() ){
       mqttClient.loop();
+      //fields not published yet, if any
+      for (uint8_t i = 0; i < s21PortsCount; i++) {
+        if ( mqttDirty[i] ){
+          mqttPublishFields(*s21Ports[i]);
+        }
+      }
     };
   }
+  loopMark(SEC_MQTT);
+  loopEnd();
 }
 
 //body for remoteDebug callback function
@@ -1440,26 +2617,76 @@ void processCmdRemoteDebug(){
     debugA("  char mqttSubTopic[64] = %s;", config.mqttSubTopic);
     debugA("  char mqttPubTopic[64] = %s;", config.mqttPubTopic);
     debugA("  uint8_t period = %i;", config.period);
+    for (uint8_t i = 0; i < S21_MAX_PORTS; i++) {
+      debugA("  uint8_t capabilitiesCheck[%u] = %i;", i, config.capabilitiesCheck[i]);
+      debugA("  uint32_t capabilities[%u] = %08X;", i, config.capabilities[i]);
+    }
+    debugA("  uint8_t filterCheck = %i;", config.filterCheck);
+    for (uint8_t i = 0; i < AC_FIELDS_COUNT; i++) {
+      debugA("  uint16_t deadBand[%s] = %u;", acFields[i].name, config.deadBand[i]);
+    }
+    debugA("  uint16_t wsMinInterval = %u, wsMaxInterval = %u;", config.wsMinInterval, config.wsMaxInterval);
+    debugA("  uint16_t mqttMinInterval = %u, mqttMaxInterval = %u;", config.mqttMinInterval, config.mqttMaxInterval);
+    debugA("  uint32_t capabilitiesTable = %08X; (table is %08X)", config.capabilitiesTable, registersHash());
     debugA("} config;");
   } else if (lastCmd == "acvalues") {
     //dumping ac values:
-    debugA("Dumping AC values");
-    debugA("struct {");
-    debugA("  bool power_on = %i;", acValues.power_on);
-    debugA("  uint8_t mode = %s;", mode_to_string(acValues.mode).c_str());
-    debugA("  uint8_t fan = %s;", speed_to_string(acValues.fan).c_str());
-    debugA("  int16_t setpoint = %i;", acValues.setpoint);
-    debugA("  bool swing_v = %i;", acValues.swing_v);
-    debugA("  bool swing_h = %i;", acValues.swing_h);
-    debugA("  int16_t temp_inside = %i;", acValues.temp_inside);
-    debugA("  int16_t temp_outside = %i;", acValues.temp_outside);
-    debugA("  int16_t temp_coil = %i;", acValues.temp_coil);
-    debugA("  uint16_t target_fan_rpm = %i;", acValues.target_fan_rpm);
-    debugA("  uint16_t fan_rpm = %i;", acValues.fan_rpm);
-    debugA("  bool idle = %i;", acValues.idle);
-    debugA("  uint8_t compressor_freq = %i;", acValues.compressor_freq);
-    debugA("  uint8_t target_angle = %i;", acValues.target_angle);
-    debugA("  uint8_t angle = %i;", acValues.angle);
-    debugA("} acValues;");
+    for (uint8_t p = 0; p < s21PortsCount; p++) {
+      const acStatus &acValues = s21Ports[p]->acValues;
+      debugA("Dumping AC values of port %u", p);
+      debugA("struct {");
+      debugA("  bool power_on = %i;", acValues.power_on);
+      debugA("  uint8_t mode = %s;", mode_to_string(acValues.mode));
+      debugA("  uint8_t fan = %s;", speed_to_string(acValues.fan));
+      debugA("  int16_t setpoint = %i;", acValues.setpoint);
+      debugA("  bool swing_v = %i;", acValues.swing_v);
+      debugA("  bool swing_h = %i;", acValues.swing_h);
+      debugA("  int16_t temp_inside = %i;", acValues.temp_inside);
+      debugA("  int16_t temp_outside = %i;", acValues.temp_outside);
+      debugA("  int16_t temp_coil = %i;", acValues.temp_coil);
+      debugA("  uint16_t target_fan_rpm = %i;", acValues.target_fan_rpm);
+      debugA("  uint16_t fan_rpm = %i;", acValues.fan_rpm);
+      debugA("  bool idle = %i;", acValues.idle);
+      debugA("  uint8_t compressor_freq = %i;", acValues.compressor_freq);
+      debugA("  uint8_t target_angle = %i;", acValues.target_angle);
+      debugA("  uint8_t angle = %i;", acValues.angle);
+      debugA("} acValues;");
+    }
+  } else if (lastCmd == "discover") {
+    //probing registers again:
+    for (uint8_t p = 0; p < s21PortsCount; p++) {
+      debugA("Starting S21 capability discovery on port %u", p);
+      s21Ports[p]->startDiscovery();
+    }
+  } else if (lastCmd == "busstats") {
+    //dumping bus timings:
+    debugA("Dumping S21 bus timings, %u frames/s on all ports, %u loops/s", frameRate, loopRate);
+    for (uint8_t p = 0; p < s21PortsCount; p++) {
+      S21Port &port = *s21Ports[p];
+      debugA("Port %u, transport %s: %u line errors, %u frames, %u bad frames", p, port.serial.name(), port.serial.errors(), port.rxStats.frames, port.rxStats.badFrames);
+      debugA("Duty cycle %.1f%%, frame gap %ums, command ACK timeout %ums", port.busDuty / 10.0, port.frameGap, timingTimeout(port.cmdAckTiming));
+      debugA("Errors: %u timeout, %u NAK, %u unexpected, %u checksum", port.errorCount(ERR_TIMEOUT), port.errorCount(ERR_NAK), port.errorCount(ERR_UNEXPECTED), port.errorCount(ERR_CHECKSUM));
+      debugA("Buckets (ms): <5 <10 <20 <40 <80 <160 <320 >=320");
+      for (uint8_t i = 0; i < acRegistersCount; i++) {
+        const acRegHealth &h = port.acRegHealths[i];
+        debugA("%s: ACK timeout %ums, frame timeout %ums", acRegisters[i].query, timingTimeout(port.acRegTimings[i].ack), timingTimeout(port.acRegTimings[i].firstByte));
+        debugA("  %u queries, errors %u/%u/%u/%u (timeout/NAK/unexpected/checksum), %u retries, %u demotions%s", h.queries,
+          h.errors[ERR_TIMEOUT], h.errors[ERR_NAK], h.errors[ERR_UNEXPECTED], h.errors[ERR_CHECKSUM], h.retries, h.demotions,
+          (port.acRegDemoted >> i) & 1 ? ", demoted" : "");
+        const timingStats *stats[3] = {&port.acRegTimings[i].ack, &port.acRegTimings[i].firstByte, &port.acRegTimings[i].frame};
+        const char *names[3] = {"ACK", "first byte", "frame"};
+        for (uint8_t t = 0; t < 3; t++) {
+          const uint16_t *h = stats[t]->hist;
+          debugA("  %-10s %u %u %u %u %u %u %u %u", names[t], h[0], h[1], h[2], h[3], h[4], h[5], h[6], h[7]);
+        }
+      }
+    }
+  } else if (lastCmd == "cmdqueue") {
+    //dumping command queues:
+    debugA("Dumping command queues: %u commands, %.0fus each, %u allocations", cmdCount, cmdCount ? (double)cmdUs / cmdCount : 0.0, cmdAllocs);
+    for (uint8_t i = 0; i < SRC_COUNT; i++) {
+      debugA("%-4s: %u received, %u pending, %u dropped (queue full), %u dropped (too long)", cmdSourceNames[i], cmdQueues[i].received,
+        (uint8_t)(cmdQueues[i].head - cmdQueues[i].tail), cmdQueues[i].overflows, cmdQueues[i].tooLong);
+    }
   }
 }
@@ -0,0 +1,191 @@
+/*
+Simulated S21 indoor unit for the native tests.
+It's the transport the engine talks to: requests written by the engine are answered with ACK/NAK
+and response frames, delivered byte by byte on the virtual clock. Latencies, faults and register
+values can be changed by tests at any time.
+*/
+#pragma once
+
+#include <S21.h>
+#include <string>
+#include <map>
+#include <deque>
+
+//virtual clock, in us
+extern uint32_t virtualMicros;
+
+class S21Peer : public s21Transport {
+  public:
+    //timings, in ms
+    uint32_t byteTime = 5; //2400 8E2 is 12 bits per byte
+    uint32_t ackLatency = 8; //end of request to ACK
+    uint32_t answerLatency = 20; //ACK to STX of the answer
+    //faults, each one is used up by the next requests
+    uint8_t nakCount = 0; //requests answered with NAK
+    uint8_t silentCount = 0; //requests not answered at all
+    uint8_t badChecksumCount = 0; //answers with a wrong checksum
+    uint8_t noiseCount = 0; //answers preceded by a garbage byte
+    //counters
+    uint32_t requests = 0, commands = 0, acks = 0, naks = 0;
+
+    //payload answered to each query, by query code. Queries not here are NAKed
+    std::map<std::string, std::string> registers;
+
+    S21Peer() { reset(); }
+
+    //back to a FTXS-like unit, powered on in cool mode, with no faults
+    void reset() {
+      ackLatency = 8;
+      answerLatency = 20;
+      nakCount = silentCount = badChecksumCount = noiseCount = 0;
+      requests = commands = acks = naks = 0;
+      rx.clear();
+      tx.clear();
+      inFrame = false;
+      sentAt = 0;
+      registers = {
+        {"F1", std::string("13") + (char)(28 + 250 / 5) + "A"}, //on, cool, 25C, auto fan
+        {"F5", "0000"},
+        {"RH", "532+"}, //23.5C
+        {"RI", "082+"}, //28.0C
+        {"Ra", "051+"}, //15.0C
+        {"RL", "021"}, //1200 rpm
+        {"Rd", "050"}, //50Hz
+        {"RK", "021"}, //1200 rpm
+        {"RM", "000"},
+        {"RN", "000"},
+        {"RG", "A"},
+        {"F3", "000"}
+      };
+    }
+
+    void begin() override {}
+    int available() override {
+      int count = 0;
+      for (const timedByte &b : tx) {
+        if ( b.time > virtualMicros ){
+          break;
+        }
+        count++;
+      }
+      return count;
+    }
+    int read(uint8_t *buf, int len) override {
+      int count = 0;
+      while ( count < len && !tx.empty() && tx.front().time <= virtualMicros ){
+        buf[count++] = tx.front().value;
+        tx.pop_front();
+      }
+      return count;
+    }
+    void write(uint8_t b) override {
+      //a lone ACK from the engine closes an answer
+      if ( !inFrame && b == ACK ){
+        acks++;
+        return;
+      }
+      if ( b == STX ){
+        inFrame = true;
+        rx.clear();
+        writeStart = virtualMicros;
+      } else if ( b == ETX && inFrame ){
+        inFrame = false;
+        //request is over when all of its bytes are on the line
+        sentAt = writeStart + (rx.size() + 2) * byteTime * 1000;
+        request(sentAt);
+      } else if ( inFrame ){
+        rx.push_back(b);
+      }
+    }
+    void write(const uint8_t *buf, uint8_t len) override {
+      for (uint8_t i = 0; i < len; i++) {
+        write(buf[i]);
+      }
+    }
+    void discardInput() override {
+      //dropping what has already been received
+      while ( !tx.empty() && tx.front().time <= virtualMicros ){
+        tx.pop_front();
+      }
+    }
+    //writes don't take virtual time, the request is on the line when its last byte is
+    uint32_t sentTime() override {
+      return std::max(virtualMicros, sentAt);
+    }
+    const char* name() override { return "peer"; }
+
+  private:
+    struct timedByte {
+      uint32_t time; //us
+      uint8_t value;
+    };
+    std::deque<timedByte> tx; //bytes to the engine, by arrival time
+    std::string rx; //request being received
+    bool inFrame = false;
+    uint32_t writeStart = 0, sentAt = 0;
+
+    void send(uint32_t &time, uint8_t b) {
+      tx.push_back({time, b});
+      time += byteTime * 1000;
+    }
+
+    //answers a complete request, ended at time
+    void request(uint32_t time) {
+      requests++;
+      if ( rx.size() < 3 ){
+        return;
+      }
+      uint8_t checksum = rx.back();
+      std::string payload = rx.substr(0, rx.size() - 1);
+      if ( s21_checksum((const uint8_t*)payload.data(), payload.size()) != checksum ){
+        return;
+      }
+      if ( silentCount > 0 ){
+        silentCount--;
+        return;
+      }
+      time += ackLatency * 1000;
+      std::string code = payload.substr(0, 2);
+      bool command = code[0] == 'D';
+      if ( nakCount > 0 || (!command && registers.find(code) == registers.end()) ){
+        if ( nakCount > 0 ) nakCount--;
+        naks++;
+        send(time, NAK);
+        return;
+      }
+      send(time, ACK);
+      if ( command ){
+        commands++;
+        apply(code, payload.substr(2));
+        return;
+      }
+      //answer is the query code moved on by one: F1 -> G1, RH -> SH
+      std::string answer = std::string(1, code[0] + 1) + code[1] + registers[code];
+      uint8_t sum = s21_checksum((const uint8_t*)answer.data(), answer.size());
+      if ( badChecksumCount > 0 ){
+        badChecksumCount--;
+        sum++;
+      }
+      time += answerLatency * 1000;
+      if ( noiseCount > 0 ){
+        noiseCount--;
+        send(time, 0xFF);
+      }
+      send(time, STX);
+      for (char c : answer) {
+        send(time, c);
+      }
+      send(time, sum);
+      send(time, ETX);
+    }
+
+    //commands change the registers they affect
+    void apply(const std::string &code, const std::string &args) {
+      if ( code == "D1" && args.size() >= 4 ){
+        registers["F1"] = args.substr(0, 4);
+        registers["RG"] = args.substr(3, 1);
+      } else if ( code == "D5" && args.size() >= 4 ){
+        registers["F5"] = args.substr(0, 4);
+      }
+    }
+};
@@ -0,0 +1,496 @@
+/*
+S21 engine against a simulated indoor unit, on a virtual clock.
+Run with: pio test -e native
+Poll cycle and command round trip times are printed, and checked against loose bounds
+so that regressions in the states-machines show up as failures.
+The telemetry history codec and rollups (lib/History) are tested here too.
+*/
+#include <unity.h>
+#include <S21.h>
+#include <History.h>
+#include <Rollup.h>
+#include "S21Peer.h"
+
+uint32_t virtualMicros = 0;
+uint32_t millis() { return virtualMicros / 1000; }
+uint32_t micros() { return virtualMicros; }
+
+//a gateway with three units. Most tests work on port 0, the others keep polling their own unit meanwhile
+#define TEST_PORTS 3
+S21Peer peers[TEST_PORTS];
+S21Port port0(peers[0], 0), port1(peers[1], 1), port2(peers[2], 2);
+S21Peer &peer = peers[0];
+S21Port &port = port0;
+
+//application hooks
+uint32_t publishCounts[TEST_PORTS], capabilitiesSaved[TEST_PORTS];
+uint32_t &publishCount = publishCounts[0];
+void publishValues(S21Port &port) {
+  if ( port.valueChanged ){
+    publishCounts[port.id]++;
+    port.valueChanged = false;
+  }
+}
+void valuesParsed(S21Port &port) {}
+bool valuesWatched(S21Port &port) { return false; }
+uint8_t pollPeriod() { return 15; }
+void saveCapabilities(S21Port &port) { capabilitiesSaved[port.id]++; }
+
+//moves time on, running the engine every ms like loop() does
+void runFor(uint32_t ms) {
+  for (uint32_t i = 0; i < ms; i++) {
+    virtualMicros += 1000;
+    s21Loop();
+  }
+}
+
+//runs until cond is true, returns elapsed ms or UINT32_MAX on timeout
+template<typename F> uint32_t runUntil(F cond, uint32_t timeout) {
+  uint32_t start = millis();
+  while ( !cond() ){
+    if ( millis() - start > timeout ){
+      return UINT32_MAX;
+    }
+    runFor(1);
+  }
+  return millis() - start;
+}
+
+//a full poll cycle: every supported register read once, back to idle
+uint32_t pollCycle() {
+  port.acRegForced = port.supportedMask();
+  runFor(1);
+  return runUntil([]{ return port.state == 0 && port.acRegForced == 0; }, 10000);
+}
+
+void resetPort(S21Port &port) {
+  port.acValues = acStatus();
+  port.state = port.cmdState = 0;
+  port.waiting = false;
+  port.valueChanged = false;
+  port.dirtyFields = 0;
+  port.acRegForced = port.acConfirmPending = port.acProbePending = 0;
+  port.acProbePasses = 0;
+  port.acCapabilities = 0;
+  port.acCapabilitiesKnown = false;
+  port.frameGap = minFrameGap;
+  for (uint8_t i = 0; i < acRegistersCount; i++) {
+    port.acRegTimings[i] = acRegTiming();
+    port.acRegLastPoll[i] = port.acRegLastRead[i] = 0;
+  }
+  port.cmdAckTiming = timingStats();
+  port.rxStats = s21RxStats();
+  for (uint8_t i = 0; i < acRegistersCount; i++) {
+    port.acRegHealths[i] = acRegHealth();
+  }
+  port.acRegDemoted = 0;
+  port.acRetries = 0;
+  port.retryPending = port.queryProbe = false;
+}
+
+void setUp() {
+  for (uint8_t i = 0; i < TEST_PORTS; i++) {
+    peers[i].reset();
+    resetPort(*s21Ports[i]);
+    publishCounts[i] = capabilitiesSaved[i] = 0;
+  }
+  //far from zero, so that "never read" is not confused with a timestamp
+  virtualMicros += 100000000UL;
+}
+void tearDown() {}
+
+void test_codec() {
+  const uint8_t frame[] = {'S', 'H', '5', '3', '2', '+'};
+  TEST_ASSERT_EQUAL_UINT8('F' + '1', s21_checksum((const uint8_t*)"F1", 2));
+  TEST_ASSERT_EQUAL_INT16(235, temp_bytes_to_c10(&frame[2]));
+  const uint8_t negative[] = {'0', '5', '0', '-'};
+  TEST_ASSERT_EQUAL_INT16(-50, temp_bytes_to_c10(negative));
+  TEST_ASSERT_EQUAL_UINT8(78, c10_to_setpoint_byte(250));
+  uint32_t version = port.valuesVersion;
+  port.parseFrame(frame, sizeof(frame));
+  TEST_ASSERT_EQUAL_INT16(235, port.acValues.temp_inside);
+  TEST_ASSERT_TRUE(port.valueChanged);
+  TEST_ASSERT_EQUAL_UINT32(version + 1, port.valuesVersion);
+  TEST_ASSERT_EQUAL_UINT32(1UL << AC_TEMP_INSIDE, port.dirtyFields);
+  //same values, caches are still good
+  port.parseFrame(frame, sizeof(frame));
+  TEST_ASSERT_EQUAL_UINT32(version + 1, port.valuesVersion);
+}
+
+void test_full_poll_cycle() {
+  uint32_t elapsed = pollCycle();
+  printf("Full poll cycle: %u ms, %u requests\n", elapsed, peer.requests);
+  TEST_ASSERT_NOT_EQUAL(UINT32_MAX, elapsed);
+  TEST_ASSERT_LESS_THAN_UINT32(1500, elapsed);
+  TEST_ASSERT_TRUE(port.acValues.power_on);
+  TEST_ASSERT_EQUAL_UINT8('3', port.acValues.mode);
+  TEST_ASSERT_EQUAL_INT16(250, port.acValues.setpoint);
+  TEST_ASSERT_EQUAL_INT16(235, port.acValues.temp_inside);
+  TEST_ASSERT_EQUAL_INT16(280, port.acValues.temp_coil);
+  TEST_ASSERT_EQUAL_INT16(150, port.acValues.temp_outside);
+  TEST_ASSERT_EQUAL_UINT16(1200, port.acValues.fan_rpm);
+  TEST_ASSERT_EQUAL_UINT8(50, port.acValues.compressor_freq);
+  TEST_ASSERT_FALSE(port.acValues.idle);
+  for (uint8_t i = 0; i < acRegistersCount; i++) {
+    if ( port.acRegSupported(i) ){
+      TEST_ASSERT_NOT_EQUAL(0, port.acRegLastRead[i]);
+    }
+  }
+  TEST_ASSERT_EQUAL_UINT32(0, port.rxStats.badFrames);
+  TEST_ASSERT_EQUAL_UINT32(1, publishCount);
+}
+
+void test_command_round_trip() {
+  pollCycle();
+  uint32_t published = publishCount;
+  port.setAcTemp(22);
+  runFor(1);
+  TEST_ASSERT_NOT_EQUAL(0, port.acConfirmPending | port.cmdState);
+  uint32_t elapsed = runUntil([]{ return port.cmdState == 0 && port.acConfirmPending == 0; }, 5000);
+  printf("Command round trip: %u ms\n", elapsed);
+  TEST_ASSERT_NOT_EQUAL(UINT32_MAX, elapsed);
+  TEST_ASSERT_LESS_THAN_UINT32(600, elapsed);
+  TEST_ASSERT_EQUAL_UINT32(1, peer.commands);
+  TEST_ASSERT_EQUAL_INT16(220, port.acValues.setpoint);
+  //published as soon as it's read back, not at the end of a poll cycle
+  TEST_ASSERT_EQUAL_UINT32(published + 1, publishCount);
+}
+
+void test_command_during_poll() {
+  port.acRegForced = port.supportedMask();
+  runFor(30);
+  TEST_ASSERT_NOT_EQUAL(0, port.state);
+  port.setAcPower(false);
+  uint32_t elapsed = runUntil([]{ return port.cmdState == 0 && port.acConfirmPending == 0 && !port.acValues.power_on; }, 5000);
+  printf("Command round trip during a poll: %u ms\n", elapsed);
+  TEST_ASSERT_NOT_EQUAL(UINT32_MAX, elapsed);
+  TEST_ASSERT_EQUAL_UINT32(1, peer.commands);
+  //read back ahead of the sweep, which is still going on
+  TEST_ASSERT_LESS_THAN_UINT32(600, elapsed);
+  TEST_ASSERT_NOT_EQUAL(0, port.acRegForced);
+}
+
+void test_nak_recovery() {
+  peer.nakCount = 3;
+  pollCycle();
+  TEST_ASSERT_EQUAL_UINT32(3, peer.naks);
+  //the registers that failed are read on their next turn: F5 is polled every 4 periods,
+  //and F1 failed too, so the unit looks off and polls are twice as slow
+  runFor(4 * 2 * pollPeriod() * 1000UL + 5000);
+  for (uint8_t i = 0; i < acRegistersCount; i++) {
+    if ( port.acRegSupported(i) ){
+      TEST_ASSERT_NOT_EQUAL(0, port.acRegLastRead[i]);
+    }
+  }
+  TEST_ASSERT_EQUAL_UINT8(minFrameGap, port.frameGap);
+}
+
+void test_retry() {
+  peer.nakCount = 1;
+  peer.badChecksumCount = 1;
+  uint32_t elapsed = pollCycle();
+  printf("Poll cycle with a NAK and a bad checksum: %u ms\n", elapsed);
+  //failed queries are retried right away, nothing is left stale
+  for (uint8_t i = 0; i < acRegistersCount; i++) {
+    if ( port.acRegSupported(i) ){
+      TEST_ASSERT_NOT_EQUAL(0, port.acRegLastRead[i]);
+    }
+  }
+  TEST_ASSERT_EQUAL_UINT32(1, port.errorCount(ERR_NAK));
+  TEST_ASSERT_EQUAL_UINT32(1, port.errorCount(ERR_CHECKSUM));
+  TEST_ASSERT_EQUAL_UINT32(0, port.errorCount(ERR_TIMEOUT));
+  uint32_t retries = 0;
+  for (uint8_t i = 0; i < acRegistersCount; i++) {
+    retries += port.acRegHealths[i].retries;
+  }
+  TEST_ASSERT_EQUAL_UINT32(2, retries);
+  TEST_ASSERT_EQUAL_UINT32(0, port.acRegDemoted);
+}
+
+void test_demotion() {
+  pollCycle();
+  //RN stops answering: it's retried, then demoted after a few polls
+  peer.registers.erase("RN");
+  uint8_t rn = 9;
+  TEST_ASSERT_EQUAL_STRING("RN", acRegisters[rn].query);
+  runUntil([rn]{ return (port.acRegDemoted & (1UL << rn)) != 0; }, 600000);
+  TEST_ASSERT_TRUE(port.acRegDemoted & (1UL << rn));
+  TEST_ASSERT_EQUAL_UINT32(demoteAfter * (1 + maxRetries), port.acRegHealths[rn].errors[ERR_NAK]);
+  //no bus time while demoted
+  uint32_t queries = port.acRegHealths[rn].queries;
+  runFor(demoteTime - 1000);
+  TEST_ASSERT_EQUAL_UINT32(queries, port.acRegHealths[rn].queries);
+  //back after the demotion, and read again as soon as it answers
+  peer.registers["RN"] = "000";
+  runFor(pollPeriod() * 1000UL * 4 + 2000);
+  TEST_ASSERT_FALSE(port.acRegDemoted & (1UL << rn));
+  TEST_ASSERT_EQUAL_UINT8(0, port.acRegHealths[rn].failStreak);
+  TEST_ASSERT_EQUAL_UINT32(1, port.acRegHealths[rn].demotions);
+}
+
+void test_checksum_recovery() {
+  peer.badChecksumCount = 2;
+  peer.noiseCount = 1;
+  pollCycle();
+  TEST_ASSERT_EQUAL_UINT32(2, port.rxStats.badFrames);
+  runFor(60000);
+  TEST_ASSERT_EQUAL_INT16(235, port.acValues.temp_inside);
+  TEST_ASSERT_EQUAL_INT16(280, port.acValues.temp_coil);
+}
+
+void test_silent_timeout() {
+  peer.silentCount = 2;
+  uint32_t elapsed = pollCycle();
+  printf("Poll cycle with 2 lost requests: %u ms\n", elapsed);
+  TEST_ASSERT_NOT_EQUAL(UINT32_MAX, elapsed);
+  //two timeouts at most, plus the grown frame gaps
+  TEST_ASSERT_LESS_THAN_UINT32(1500 + 2 * (defaultTimeout + maxFrameGap), elapsed);
+}
+
+void test_command_lost() {
+  pollCycle();
+  peer.silentCount = 1;
+  port.setAcFan('5');
+  uint32_t elapsed = runUntil([]{ return port.cmdState == 0 && port.acRegForced == 0 && port.state == 0; }, 5000);
+  TEST_ASSERT_NOT_EQUAL(UINT32_MAX, elapsed);
+  //not acknowledged, so nothing changed on the unit
+  TEST_ASSERT_EQUAL_UINT32(0, peer.commands);
+  TEST_ASSERT_EQUAL_UINT8('A', port.acValues.fan);
+}
+
+void test_command_preempts_retry() {
+  //a poll with a lost request, waiting to retry it when the command comes
+  peer.silentCount = 1;
+  port.acRegForced = port.supportedMask();
+  runFor(1);
+  TEST_ASSERT_NOT_EQUAL(UINT32_MAX, runUntil([]{ return port.state == 5 && port.waiting && port.retryPending; }, 5000));
+  port.setAcTemp(22);
+  runFor(1);
+  TEST_ASSERT_FALSE(port.waiting);
+  TEST_ASSERT_NOT_EQUAL(UINT32_MAX, runUntil([]{ return port.cmdState == 0; }, 5000));
+  //the first query after the command is lost too, and is retried like any other
+  peer.silentCount = 1;
+  uint32_t elapsed = runUntil([]{ return port.state == 0 && port.acRegForced == 0 && port.acConfirmPending == 0; }, 10000);
+  TEST_ASSERT_NOT_EQUAL(UINT32_MAX, elapsed);
+  TEST_ASSERT_EQUAL_UINT32(2, port.errorCount(ERR_TIMEOUT));
+  uint32_t retries = 0;
+  for (uint8_t i = 0; i < acRegistersCount; i++) {
+    retries += port.acRegHealths[i].retries;
+    //the preempted one included
+    if ( port.acRegSupported(i) ){
+      TEST_ASSERT_NOT_EQUAL(0, port.acRegLastRead[i]);
+    }
+  }
+  TEST_ASSERT_EQUAL_UINT32(2, retries);
+  TEST_ASSERT_EQUAL_INT16(220, port.acValues.setpoint);
+}
+
+void test_ac_set() {
+  pollCycle();
+  //a scene: setpoint, fan and swing in one bus transaction per frame
+  acSettings settings;
+  settings.setTemp(21);
+  settings.setFan('5');
+  settings.setSwingV(true);
+  port.setAc(settings);
+  uint32_t elapsed = runUntil([]{ return port.cmdState == 0 && port.acConfirmPending == 0; }, 5000);
+  printf("acSet round trip, D1 and D5: %u ms\n", elapsed);
+  TEST_ASSERT_NOT_EQUAL(UINT32_MAX, elapsed);
+  TEST_ASSERT_LESS_THAN_UINT32(800, elapsed);
+  TEST_ASSERT_EQUAL_UINT32(2, peer.commands);
+  TEST_ASSERT_EQUAL_INT16(210, port.acValues.setpoint);
+  TEST_ASSERT_EQUAL_UINT8('5', port.acValues.fan);
+  TEST_ASSERT_TRUE(port.acValues.swing_v);
+  //what is not set is kept
+  TEST_ASSERT_TRUE(port.acValues.power_on);
+  TEST_ASSERT_EQUAL_UINT8('3', port.acValues.mode);
+  TEST_ASSERT_FALSE(port.acValues.swing_h);
+  //settings of one frame only are one command
+  acSettings off;
+  off.setHaMode(0);
+  port.setAc(off);
+  TEST_ASSERT_NOT_EQUAL(UINT32_MAX, runUntil([]{ return port.cmdState == 0 && port.acConfirmPending == 0; }, 5000));
+  TEST_ASSERT_EQUAL_UINT32(3, peer.commands);
+  TEST_ASSERT_FALSE(port.acValues.power_on);
+  TEST_ASSERT_EQUAL_INT16(210, port.acValues.setpoint);
+}
+
+void test_discovery() {
+  peer.registers.erase("RN");
+  peer.registers.erase("RM");
+  port.startDiscovery();
+  uint32_t elapsed = runUntil([]{ return port.acProbePasses == 0; }, 20000);
+  printf("Discovery: %u ms\n", elapsed);
+  TEST_ASSERT_NOT_EQUAL(UINT32_MAX, elapsed);
+  TEST_ASSERT_EQUAL_UINT32(1, capabilitiesSaved[0]);
+  TEST_ASSERT_TRUE(port.acCapabilitiesKnown);
+  for (uint8_t i = 0; i < acRegistersCount; i++) {
+    bool answers = peer.registers.count(acRegisters[i].query) > 0;
+    TEST_ASSERT_EQUAL(answers, (port.acCapabilities >> i) & 1);
+  }
+  //unsupported registers are not polled anymore
+  uint32_t requests = peer.requests;
+  pollCycle();
+  TEST_ASSERT_EQUAL_UINT32(requests + __builtin_popcount(port.supportedMask()), peer.requests);
+}
+
+void test_adaptive_timeouts() {
+  peer.ackLatency = 40;
+  for (uint8_t i = 0; i < 10; i++) {
+    pollCycle();
+  }
+  uint16_t timeout = timingTimeout(port.acRegTimings[0].ack);
+  printf("ACK timeout with 40ms latency: %u ms\n", timeout);
+  TEST_ASSERT_GREATER_THAN_UINT16(40, timeout);
+  TEST_ASSERT_LESS_THAN_UINT16(defaultTimeout, timeout);
+  //slower unit: no timeouts, timeouts follow
+  peer.ackLatency = 70;
+  for (uint8_t i = 0; i < 10; i++) {
+    pollCycle();
+  }
+  TEST_ASSERT_GREATER_THAN_UINT16(70, timingTimeout(port.acRegTimings[0].ack));
+  TEST_ASSERT_EQUAL_UINT32(0, port.rxStats.badFrames);
+}
+
+void test_multi_port() {
+  //a poll cycle on port 0 alone, once the other ports are done with their first poll
+  runFor(5000);
+  uint32_t frames = port.rxStats.frames;
+  uint32_t single = pollCycle();
+  frames = port.rxStats.frames - frames;
+  //all of them together: frames are interleaved, so a cycle takes about as long
+  runFor(5000);
+  uint32_t framesBefore = 0, framesAfter = 0;
+  for (uint8_t i = 0; i < TEST_PORTS; i++) {
+    framesBefore += s21Ports[i]->rxStats.frames;
+    s21Ports[i]->acRegForced = s21Ports[i]->supportedMask();
+  }
+  uint32_t elapsed = runUntil([]{
+    for (uint8_t i = 0; i < TEST_PORTS; i++) {
+      if ( s21Ports[i]->state != 0 || s21Ports[i]->acRegForced != 0 ) return false;
+    }
+    return true;
+  }, 10000);
+  for (uint8_t i = 0; i < TEST_PORTS; i++) {
+    framesAfter += s21Ports[i]->rxStats.frames;
+  }
+  printf("Poll cycle: %u ms on one port, %u ms on %u ports (%u frames/s)\n", single, elapsed, TEST_PORTS,
+    elapsed ? (framesAfter - framesBefore) * 1000 / elapsed : 0);
+  TEST_ASSERT_NOT_EQUAL(UINT32_MAX, elapsed);
+  TEST_ASSERT_LESS_THAN_UINT32(single + single / 4, elapsed);
+  TEST_ASSERT_EQUAL_UINT32(TEST_PORTS * frames, framesAfter - framesBefore);
+  //commands go to their own unit only
+  port1.setAcTemp(21);
+  elapsed = runUntil([]{ return s21CommandsReady(); }, 5000);
+  TEST_ASSERT_NOT_EQUAL(UINT32_MAX, elapsed);
+  TEST_ASSERT_EQUAL_UINT32(0, peers[0].commands);
+  TEST_ASSERT_EQUAL_UINT32(1, peers[1].commands);
+  TEST_ASSERT_EQUAL_UINT32(0, peers[2].commands);
+  TEST_ASSERT_EQUAL_INT16(210, port1.acValues.setpoint);
+  TEST_ASSERT_EQUAL_INT16(250, port0.acValues.setpoint);
+  TEST_ASSERT_EQUAL_INT16(250, port2.acValues.setpoint);
+}
+
+void test_history() {
+  static historyRing ring;
+  historySample s;
+  s.time = 1700000000;
+  s.values[0] = 235;
+  s.values[1] = -50;
+  s.values[3] = 40;
+  //a day at one sample a minute, slowly changing, with a jump now and then
+  const uint32_t samples = 1440;
+  for (uint32_t i = 0; i < samples; i++) {
+    s.time += 60;
+    s.values[0] += (i % 7 == 0) - (i % 11 == 0);
+    s.values[3] = i % 90 < 30 ? 0 : 40 + i % 5;
+    s.values[5] = i % 300 == 0 ? 100000 : 0;
+    ring.add(s);
+  }
+  printf("History: %u samples in %u blocks of %u bytes\n", samples, ring.current() + 1, HISTORY_BLOCK_SIZE);
+  TEST_ASSERT_LESS_THAN_UINT32(samples * 6 / (HISTORY_BLOCK_SIZE - 4) + 2, ring.current() + 1);
+  //blocks still in RAM decode back to the newest samples, in order, the last one being the latest added
+  TEST_ASSERT_NULL(ring.block(ring.oldest() - 1));
+  TEST_ASSERT_NULL(ring.block(ring.current() + 1));
+  historySample r, prev;
+  uint32_t count = 0;
+  for (uint32_t n = ring.oldest(); n <= ring.current(); n++) {
+    historyBlockReader reader(ring.block(n));
+    while ( reader.next(r) ){
+      if ( count++ > 0 ){
+        TEST_ASSERT_EQUAL_UINT32(prev.time + 60, r.time);
+      }
+      prev = r;
+    }
+  }
+  TEST_ASSERT_GREATER_THAN_UINT32(HISTORY_RING_BLOCKS * 40, count);
+  TEST_ASSERT_EQUAL_UINT32(s.time, r.time);
+  TEST_ASSERT_EQUAL_INT32_ARRAY(s.values, r.values, HISTORY_VALUES);
+  //a damaged block stops the reader, it doesn't read past the data
+  historyBlock damaged = *ring.block(ring.current() - 1);
+  damaged.used = 3;
+  historyBlockReader reader(&damaged);
+  count = 0;
+  while ( reader.next(r) ){
+    count++;
+  }
+  TEST_ASSERT_LESS_OR_EQUAL_UINT32(1, count);
+}
+
+void test_rollup() {
+  static rollup r;
+  const uint32_t t0 = 1700000000 - 1700000000 % 86400 + 3600; //1am
+  //two hours, a sample a second: 20C then 22C inside, compressor at 40Hz for 10 minutes every 30
+  for (uint32_t t = t0; t <= t0 + 7200; t++) {
+    int16_t temps[ROLLUP_TEMPS] = {(int16_t)(t < t0 + 3600 ? 200 : 220), -50, (int16_t)(100 + (t - t0) % 7)};
+    r.add(t, temps, (t - t0) % 1800 < 600 ? 40 : 0);
+  }
+  TEST_ASSERT_EQUAL_UINT8((1 << ROLLUP_MINUTE) | (1 << ROLLUP_HOUR), r.closed);
+  const rollupWindow &hour = r.last[ROLLUP_HOUR];
+  TEST_ASSERT_EQUAL_UINT32(t0 + 3600, hour.start);
+  TEST_ASSERT_EQUAL_UINT32(3600, hour.covered);
+  TEST_ASSERT_EQUAL_INT32(220, hour.mean(0));
+  TEST_ASSERT_EQUAL_INT16(220, hour.min[0]);
+  TEST_ASSERT_EQUAL_INT16(-50, hour.max[1]);
+  TEST_ASSERT_EQUAL_INT16(100, hour.min[2]);
+  TEST_ASSERT_EQUAL_INT16(106, hour.max[2]);
+  TEST_ASSERT_EQUAL_INT32(103, hour.mean(2));
+  TEST_ASSERT_EQUAL_UINT32(1200, hour.compressorOn);
+  TEST_ASSERT_EQUAL_UINT16(2, hour.starts);
+  TEST_ASSERT_EQUAL_UINT32(40 * 1200, hour.load);
+  //the day goes on, with both hours in it
+  const rollupWindow &day = r.current[ROLLUP_DAY];
+  TEST_ASSERT_EQUAL_UINT32(7200, day.covered);
+  TEST_ASSERT_EQUAL_INT32(210, day.mean(0));
+  TEST_ASSERT_EQUAL_UINT16(4, day.starts); //the last sample starts it again
+  TEST_ASSERT_EQUAL_UINT32(60, r.last[ROLLUP_MINUTE].covered);
+  //a hole in the data is not held values, and windows close anyway
+  r.closed = 0;
+  r.roll(t0 + 7200 + 1000);
+  TEST_ASSERT_EQUAL_UINT8(1 << ROLLUP_MINUTE, r.closed);
+  int16_t temps[ROLLUP_TEMPS] = {220, -50, 100};
+  r.add(t0 + 7200 + 1000, temps, 0);
+  TEST_ASSERT_EQUAL_UINT32(7200, r.current[ROLLUP_DAY].covered);
+}
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_codec);
+  RUN_TEST(test_full_poll_cycle);
+  RUN_TEST(test_command_round_trip);
+  RUN_TEST(test_command_during_poll);
+  RUN_TEST(test_nak_recovery);
+  RUN_TEST(test_retry);
+  RUN_TEST(test_demotion);
+  RUN_TEST(test_checksum_recovery);
+  RUN_TEST(test_silent_timeout);
+  RUN_TEST(test_command_lost);
+  RUN_TEST(test_command_preempts_retry);
+  RUN_TEST(test_ac_set);
+  RUN_TEST(test_discovery);
+  RUN_TEST(test_adaptive_timeouts);
+  RUN_TEST(test_multi_port);
+  RUN_TEST(test_history);
+  RUN_TEST(test_rollup);
+  return UNITY_END();
+}